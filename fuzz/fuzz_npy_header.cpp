@@ -0,0 +1,26 @@
+// libFuzzer target for the npy header parser, on a buffer and through a FILE
+// as used when appending
+
+#include "../include/cnpy/cnpy.hpp"
+#include <cstdint>
+#include <cstdio>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  size_t word_size;
+  std::vector<size_t> shape;
+  bool fortran_order;
+
+  try {
+    cnpy::parse_npy_header(data, size, word_size, shape, fortran_order);
+  } catch (const std::runtime_error &) {
+  }
+
+  if (size > 0) {
+    cnpy::file_ptr fp(fmemopen(const_cast<uint8_t *>(data), size, "rb"));
+    try {
+      cnpy::parse_npy_header(fp.get(), word_size, shape, fortran_order);
+    } catch (const std::runtime_error &) {
+    }
+  }
+  return 0;
+}
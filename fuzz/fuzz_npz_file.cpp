@@ -0,0 +1,49 @@
+// libFuzzer target for whole npz and npy files: zip footer, zip64 records,
+// central directory, local headers and the members they point to
+
+#include "../include/cnpy/cnpy.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <unistd.h>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  // npz_file and npy_file read through a file descriptor
+  static const std::string fname =
+      "/tmp/cnpy_fuzz_npz_" + std::to_string(getpid());
+  {
+    const cnpy::file_ptr fp(fopen(fname.c_str(), "wb"));
+    if (!fp || fwrite(data, 1, size, fp.get()) != size) {
+      return 0;
+    }
+  }
+
+  try {
+    const cnpy::npz_file npz(fname);
+    for (const std::string &name : npz.names()) {
+      try {
+        (void)npz.load(name);
+      } catch (const std::runtime_error &) {
+      }
+    }
+  } catch (const std::runtime_error &) {
+  }
+
+  try {
+    (void)cnpy::npy_file(fname).load();
+  } catch (const std::runtime_error &) {
+  }
+
+  // the footer parser used by npz_save when appending
+  if (size > 0) {
+    cnpy::file_ptr fp(fmemopen(const_cast<uint8_t *>(data), size, "rb"));
+    uint16_t nrecs;
+    size_t global_header_size;
+    size_t global_header_offset;
+    try {
+      cnpy::parse_zip_footer(fp.get(), nrecs, global_header_size,
+                             global_header_offset);
+    } catch (const std::runtime_error &) {
+    }
+  }
+  return 0;
+}
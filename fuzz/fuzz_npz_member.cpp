@@ -0,0 +1,110 @@
+// libFuzzer target for the decoding of compressed and filtered npz members.
+// the input is wrapped into a valid single member archive, so the fuzzer
+// does not have to find the zip structures first:
+//   byte 0     compression method (none, deflate or zstd)
+//   byte 1     filter applied on loading, 0 for none
+//   bytes 2-5  uncompressed size, little endian
+//   rest       member data
+
+#include "../include/cnpy/cnpy.hpp"
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <unistd.h>
+
+namespace {
+
+using cnpy::operator+=;
+
+std::vector<char> single_member_zip(const uint16_t method,
+                                    const uint8_t filter_id,
+                                    const uint32_t uncompr_bytes,
+                                    const uint8_t *data, const uint32_t size) {
+  const std::string fname = "a.npy";
+  std::vector<char> extra_field;
+  if (filter_id != 0) {
+    extra_field += cnpy::npz_filter_extra_id;
+    extra_field += static_cast<uint16_t>(2);
+    extra_field += static_cast<uint8_t>(1);
+    extra_field += filter_id;
+  }
+
+  // clang-format off
+  std::vector<char> record;
+  record += static_cast<uint16_t>(20);                 // min version to extract
+  record += static_cast<uint16_t>(0);                  // general purpose flags
+  record += method;                                    // compression method
+  record += static_cast<uint32_t>(0);                  // file mod time and date
+  record += static_cast<uint32_t>(0);                  // crc, not checked
+  record += size;                                      // compressed size
+  record += uncompr_bytes;                             // uncompressed size
+  record += static_cast<uint16_t>(fname.size());       // fname length
+  record += static_cast<uint16_t>(extra_field.size()); // extra field length
+  // clang-format on
+
+  std::vector<char> zip;
+  zip += "PK";
+  zip += static_cast<uint16_t>(0x0403);
+  zip.insert(zip.end(), record.begin(), record.end());
+  zip += fname;
+  zip.insert(zip.end(), extra_field.begin(), extra_field.end());
+  zip.insert(zip.end(), data, data + size);
+
+  const auto global_header_offset = static_cast<uint32_t>(zip.size());
+  zip += "PK";
+  zip += static_cast<uint16_t>(0x0201);
+  zip += static_cast<uint16_t>(20); // version made by
+  zip.insert(zip.end(), record.begin(), record.end());
+  zip += static_cast<uint16_t>(0); // file comment length
+  zip += static_cast<uint16_t>(0); // disk number where file starts
+  zip += static_cast<uint16_t>(0); // internal file attributes
+  zip += static_cast<uint32_t>(0); // external file attributes
+  zip += static_cast<uint32_t>(0); // offset of local file header
+  zip += fname;
+  zip.insert(zip.end(), extra_field.begin(), extra_field.end());
+  const auto global_header_size =
+      static_cast<uint32_t>(zip.size() - global_header_offset);
+
+  zip += "PK";
+  zip += static_cast<uint16_t>(0x0605);
+  zip += static_cast<uint16_t>(0); // number of this disk
+  zip += static_cast<uint16_t>(0); // disk where footer starts
+  zip += static_cast<uint16_t>(1); // number of records on this disk
+  zip += static_cast<uint16_t>(1); // total number of records
+  zip += global_header_size;
+  zip += global_header_offset;
+  zip += static_cast<uint16_t>(0); // zip file comment length
+  return zip;
+}
+
+} // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  constexpr std::array<cnpy::compression, 3> methods{
+      cnpy::compression::none, cnpy::compression::deflate,
+      cnpy::compression::zstd};
+  if (size < 6 || size - 6 > UINT32_MAX) {
+    return 0;
+  }
+
+  const cnpy::compression method = methods[data[0] % methods.size()];
+  const std::vector<char> zip = single_member_zip(
+      static_cast<uint16_t>(method), data[1] % 4,
+      cnpy::read_le<uint32_t>(data + 2), data + 6,
+      static_cast<uint32_t>(size - 6));
+
+  static const std::string fname =
+      "/tmp/cnpy_fuzz_member_" + std::to_string(getpid());
+  {
+    const cnpy::file_ptr fp(fopen(fname.c_str(), "wb"));
+    if (!fp || fwrite(zip.data(), 1, zip.size(), fp.get()) != zip.size()) {
+      return 0;
+    }
+  }
+
+  try {
+    (void)cnpy::npz_file(fname).load("a");
+  } catch (const std::runtime_error &) {
+  }
+  return 0;
+}
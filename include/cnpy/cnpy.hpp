@@ -6,19 +6,33 @@
 #ifndef LIBCNPY_HPP
 #define LIBCNPY_HPP
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <bit>
-#include <cassert>
+#include <charconv>
 #include <complex>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <filesystem>
+#include <future>
 #include <iostream>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <numeric>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
 #include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <zlib.h>
 
@@ -40,12 +54,40 @@ struct npy_array {
 
   // TODO: can this be noexcept (because of reinterpret_cast)?
   template <typename T> constexpr T *data() {
-    return reinterpret_cast<T *>(data_holder_->data());
+    return reinterpret_cast<T *>(data_holder_->data() + offset_);
   }
 
   // TODO: can this be noexcept (because of reinterpret_cast)?
   template <typename T> constexpr T *data() const {
-    return reinterpret_cast<T *>(data_holder_->data());
+    return reinterpret_cast<T *>(data_holder_->data() + offset_);
+  }
+
+  // view of the indices [begin, end) of the outermost axis, which is the first
+  // axis in C order and the last one in fortran order. the view is contiguous
+  // and shares the data with this array
+  [[nodiscard]] npy_array slice(const size_t begin, const size_t end) const {
+    if (shape_.empty()) {
+      throw std::runtime_error("npy_array::slice: cannot slice a 0-d array");
+    }
+    const size_t axis = fortran_order_ ? shape_.size() - 1 : 0;
+    if (begin > end || end > shape_[axis]) {
+      throw std::out_of_range("npy_array::slice: range [" +
+                              std::to_string(begin) + ", " +
+                              std::to_string(end) + ") out of bounds");
+    }
+
+    size_t stride = 1;
+    for (size_t i = 0; i < shape_.size(); i++) {
+      if (i != axis) {
+        stride *= shape_[i];
+      }
+    }
+
+    npy_array view = *this;
+    view.shape_[axis] = end - begin;
+    view.num_vals_ = stride * (end - begin);
+    view.offset_ += begin * stride * word_size_;
+    return view;
   }
 
   template <typename T> std::vector<T> as_vec() const {
@@ -54,7 +96,7 @@ struct npy_array {
   }
 
   [[nodiscard]] constexpr size_t num_bytes() const noexcept {
-    return data_holder_->size();
+    return num_vals_ * word_size_;
   }
   [[nodiscard]] constexpr size_t num_vals() const noexcept { return num_vals_; }
   [[nodiscard]] constexpr size_t word_size() const noexcept {
@@ -76,10 +118,35 @@ private:
   size_t word_size_;
   bool fortran_order_;
   size_t num_vals_;
+  // byte offset of the data in data_holder_, non-zero for slices
+  size_t offset_ = 0;
 };
 
 using npz_t = std::map<std::string, npy_array>;
 
+// compression of npz members, the values are the zip compression method ids
+enum class compression : uint16_t {
+  none = 0,
+  deflate = 8,
+  // written as independent frames followed by a seek table (zstd seekable
+  // format), only available when built with WITH_ZSTD
+  zstd = 93,
+};
+
+// reversible filters applied to the array data of npz members before
+// compression. they are recorded in a zip extra field (npz_filter_extra_id)
+// and undone when loading with cnpy, other readers see the filtered bytes
+enum class filter : uint8_t {
+  // groups the n-th byte of all elements together
+  shuffle = 1,
+  // shuffle, then groups the n-th bit of every byte group together
+  bitshuffle = 2,
+  // difference to the previous element, for integers of 1, 2, 4 or 8 bytes
+  delta = 3,
+};
+
+constexpr uint16_t npz_filter_extra_id = 0x4e43;
+
 consteval char get_endianness() {
   if constexpr (std::endian::native == std::endian::little)
     return '<';
@@ -120,18 +187,305 @@ template <typename T> consteval char map_type() {
   return '?';
 }
 
+// reads a little endian integer from a possibly unaligned buffer
+template <typename T> constexpr T read_le(const unsigned char *buffer) {
+  T value = 0;
+  for (size_t byte = 0; byte < sizeof(T); byte++) {
+    value |= static_cast<T>(buffer[byte]) << (8 * byte);
+  }
+  return value;
+}
+
+consteval size_t num_digits(size_t value) {
+  size_t digits = 1;
+  while (value >= 10) {
+    value /= 10;
+    digits++;
+  }
+  return digits;
+}
+
+// the part of the header dict that only depends on the type and the memory
+// order, i.e. "{'descr': '<f8', 'fortran_order': False, 'shape': ("
+template <typename T, bool FortranOrder = false> struct npy_dict_prefix {
+  static constexpr std::string_view head = "{'descr': '";
+  static constexpr std::string_view tail =
+      FortranOrder ? "', 'fortran_order': True, 'shape': ("
+                   : "', 'fortran_order': False, 'shape': (";
+  static constexpr size_t size =
+      head.size() + 2 + num_digits(sizeof(T)) + tail.size();
+
+  static constexpr std::array<char, size> value = [] {
+    std::array<char, size> prefix{};
+    auto it = std::copy(head.begin(), head.end(), prefix.begin());
+    *it++ = get_endianness();
+    *it++ = map_type<T>();
+    size_t word_size = sizeof(T);
+    for (size_t i = num_digits(sizeof(T)); i > 0; i--) {
+      it[i - 1] = static_cast<char>('0' + word_size % 10);
+      word_size /= 10;
+    }
+    it += num_digits(sizeof(T));
+    std::copy(tail.begin(), tail.end(), it);
+    return prefix;
+  }();
+};
+
+// upper bound of the header size for an array with `rank` dimensions:
+// preamble, prefix, up to 20 digits and ", " per dimension, "), }" and the
+// padding to the next multiple of 16 bytes
+template <typename T> constexpr size_t npy_header_capacity(const size_t rank) {
+  return 10 + npy_dict_prefix<T>::size + rank * 22 + 5 + 16;
+}
+
+// writes the complete npy header (preamble + padded dict) to `out`, which has
+// to hold at least max(npy_header_capacity<T>(rank), min_size) bytes, and
+// returns its size. min_size is used to rewrite the header of an existing
+// file in place and has to be a multiple of 16
 template <typename T>
-std::vector<char> create_npy_header(const std::vector<size_t> &shape);
+size_t write_npy_header(char *out, const size_t *shape, const size_t rank,
+                        const bool fortran_order = false,
+                        const size_t min_size = 0) {
+  char *const dict = out + 10;
+  char *it = fortran_order
+                 ? std::copy(npy_dict_prefix<T, true>::value.begin(),
+                             npy_dict_prefix<T, true>::value.end(), dict)
+                 : std::copy(npy_dict_prefix<T>::value.begin(),
+                             npy_dict_prefix<T>::value.end(), dict);
+  for (size_t i = 0; i < rank; i++) {
+    if (i > 0) {
+      *it++ = ',';
+      *it++ = ' ';
+    }
+    it = std::to_chars(it, it + 20, shape[i]).ptr;
+  }
+  if (rank == 1) {
+    *it++ = ',';
+  }
+  for (const char c : std::string_view("), }")) {
+    *it++ = c;
+  }
+
+  // pad with spaces so that preamble+dict is modulo 16 bytes. preamble is 10
+  // bytes. dict needs to end with \n
+  const size_t dict_len = static_cast<size_t>(it - dict);
+  const size_t padded_len =
+      std::max(dict_len + 16 - (10 + dict_len) % 16,
+               min_size > 10 ? min_size - 10 : size_t{0});
+  std::fill(it, dict + padded_len, ' ');
+  dict[padded_len - 1] = '\n';
+
+  constexpr std::string_view magic("\x93NUMPY\x01\x00", 8);
+  std::copy(magic.begin(), magic.end(), out);
+  // header length is stored in little endian
+  out[8] = static_cast<char>(padded_len & 0xff);
+  out[9] = static_cast<char>(padded_len >> 8);
+
+  return 10 + padded_len;
+}
+
+// npy header for arrays with a fixed number of dimensions, built in a stack
+// buffer without any allocations
+template <typename T, size_t Rank> struct npy_header {
+  static constexpr size_t capacity = npy_header_capacity<T>(Rank);
+
+  explicit npy_header(const std::array<size_t, Rank> &shape,
+                      const bool fortran_order = false)
+      : size_(write_npy_header<T>(buffer_.data(), shape.data(), Rank,
+                                  fortran_order)) {}
+
+  [[nodiscard]] const char *data() const noexcept { return buffer_.data(); }
+  [[nodiscard]] size_t size() const noexcept { return size_; }
+
+private:
+  std::array<char, capacity> buffer_;
+  size_t size_;
+};
+
+struct file_closer {
+  void operator()(FILE *fp) const noexcept { fclose(fp); }
+};
+using file_ptr = std::unique_ptr<FILE, file_closer>;
+
+template <typename T>
+std::vector<char> create_npy_header(const std::vector<size_t> &shape,
+                                    bool fortran_order = false,
+                                    size_t min_size = 0);
 void parse_npy_header(FILE *fp, size_t &word_size, std::vector<size_t> &shape,
                       bool &fortran_order);
-void parse_npy_header(unsigned char *buffer, size_t &word_size,
-                      std::vector<size_t> &shape, bool &fortran_order);
+// parses the npy header at the start of buffer, which holds size bytes.
+// throws if the header is malformed or truncated
+void parse_npy_header(const unsigned char *buffer, size_t size,
+                      size_t &word_size, std::vector<size_t> &shape,
+                      bool &fortran_order);
 void parse_zip_footer(FILE *fp, uint16_t &nrecs, size_t &global_header_size,
                       size_t &global_header_offset);
+// moves the data of an npy file from behind a header of old_size bytes to
+// behind one of new_size bytes, when appending has grown the header
+void grow_npy_header(FILE *fp, size_t old_size, size_t new_size);
+[[nodiscard]] bool compression_supported(compression method) noexcept;
+// compresses an npz member, i.e. the npy header followed by the array data
+std::vector<char> compress_npz_member(compression method, const char *header,
+                                      size_t header_size, const void *data,
+                                      size_t nbytes);
+// applies the filters in order to a copy of data
+std::vector<char> filter_npz_data(const std::vector<filter> &filters,
+                                  const void *data, size_t nbytes,
+                                  size_t word_size);
+// undoes the filters (in reverse order) in place
+void unfilter_npz_data(const std::vector<filter> &filters, char *data,
+                       size_t nbytes, size_t word_size);
 npz_t npz_load(const std::string &fname);
 npy_array npz_load(const std::string &fname, const std::string &varname);
 npy_array npy_load(const std::string &fname);
 
+// read-only file that can be shared by many threads: every read names its
+// offset (pread) instead of moving a shared file position
+class read_only_file {
+public:
+  explicit read_only_file(const std::string &fname);
+  ~read_only_file();
+
+  read_only_file(read_only_file &&other) noexcept;
+  read_only_file &operator=(read_only_file &&other) noexcept;
+  read_only_file(const read_only_file &) = delete;
+  read_only_file &operator=(const read_only_file &) = delete;
+
+  // reads exactly nbytes at offset, throws if the file is too short
+  void read(void *out, size_t nbytes, uint64_t offset) const;
+  // hints the OS to read ahead aggressively, as the file is read front to back
+  void advise_sequential() const noexcept;
+
+  [[nodiscard]] uint64_t size() const noexcept { return size_; }
+
+private:
+  int fd_ = -1;
+  uint64_t size_ = 0;
+};
+
+// an opened .npy file. the header is parsed once, loads and reads can then
+// be done concurrently from any number of threads
+class npy_file {
+public:
+  explicit npy_file(const std::string &fname);
+
+  [[nodiscard]] npy_array load() const;
+  // reads nbytes of the array data, starting offset bytes after its first
+  // element
+  void read(void *out, size_t nbytes, uint64_t offset) const;
+  void advise_sequential() const noexcept { file_.advise_sequential(); }
+
+  [[nodiscard]] const std::vector<size_t> &shape() const noexcept {
+    return shape_;
+  }
+  [[nodiscard]] size_t word_size() const noexcept { return word_size_; }
+  // the dtype from the header, e.g. "<f8"
+  [[nodiscard]] const std::string &descr() const noexcept { return descr_; }
+  [[nodiscard]] bool fortran_order() const noexcept { return fortran_order_; }
+  [[nodiscard]] uint64_t data_offset() const noexcept { return data_offset_; }
+  [[nodiscard]] uint64_t num_bytes() const noexcept { return num_bytes_; }
+
+private:
+  std::string fname_;
+  read_only_file file_;
+  std::vector<size_t> shape_;
+  std::string descr_;
+  size_t word_size_ = 0;
+  bool fortran_order_ = false;
+  uint64_t data_offset_ = 0;
+  uint64_t num_bytes_ = 0;
+};
+
+// rows [first_row, first_row + num_rows) of an array, read by
+// npy_batch_reader. the data is only valid until the next call to next()
+struct npy_batch {
+  size_t first_row;
+  size_t num_rows;
+  const char *bytes;
+  size_t num_bytes;
+
+  template <typename T> const T *data() const {
+    return reinterpret_cast<const T *>(bytes);
+  }
+};
+
+// reads a C order .npy file front to back in batches of batch_rows rows
+// (along the first axis). a background thread reads up to num_buffers - 1
+// batches ahead of the one being processed
+class npy_batch_reader {
+public:
+  npy_batch_reader(const std::string &fname, size_t batch_rows,
+                   size_t num_buffers = 3);
+  ~npy_batch_reader();
+
+  npy_batch_reader(const npy_batch_reader &) = delete;
+  npy_batch_reader &operator=(const npy_batch_reader &) = delete;
+
+  // the next batch, or nothing after the last one. rethrows read errors
+  [[nodiscard]] std::optional<npy_batch> next();
+
+  [[nodiscard]] const std::vector<size_t> &shape() const noexcept {
+    return file_.shape();
+  }
+  [[nodiscard]] size_t word_size() const noexcept { return file_.word_size(); }
+  [[nodiscard]] size_t num_batches() const noexcept { return num_batches_; }
+
+private:
+  struct buffer {
+    std::vector<char> data;
+    size_t batch;
+    size_t num_rows;
+    std::exception_ptr error;
+  };
+
+  void read_ahead();
+
+  npy_file file_;
+  size_t batch_rows_;
+  size_t row_bytes_;
+  size_t num_rows_;
+  size_t num_batches_;
+  std::vector<buffer> buffers_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  size_t next_batch_ = 0; // next batch handed out by next()
+  size_t released_ = 0;   // batches the consumer is done with
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+// an opened .npz file. the central directory is read once, members can then
+// be loaded concurrently from any number of threads
+class npz_file {
+public:
+  explicit npz_file(const std::string &fname);
+
+  [[nodiscard]] npy_array load(const std::string &varname) const;
+  [[nodiscard]] npz_t load_all() const;
+
+  [[nodiscard]] bool contains(const std::string &varname) const {
+    return members_.contains(varname);
+  }
+  [[nodiscard]] std::vector<std::string> names() const;
+
+private:
+  struct member {
+    uint16_t compr_method;
+    uint64_t compr_bytes;
+    uint64_t uncompr_bytes;
+    uint64_t local_header_offset;
+    std::vector<filter> filters;
+  };
+
+  [[nodiscard]] npy_array load(const member &m) const;
+  [[nodiscard]] npy_array read_member(const member &m) const;
+
+  std::string fname_;
+  read_only_file file_;
+  std::map<std::string, member> members_;
+};
+
 template <typename T>
 constexpr std::vector<char> &operator+=(std::vector<char> &lhs, const T rhs) {
   // write in little endian
@@ -152,84 +506,184 @@ constexpr std::vector<char> &operator+=(std::vector<char> &lhs,
 template <>
 constexpr std::vector<char> &operator+=(std::vector<char> &lhs,
                                         const char *rhs) {
-  // write in little endian
-  const size_t len = std::string_view(rhs).size();
-  lhs.reserve(len);
-  for (size_t byte = 0; byte < len; byte++) {
-    lhs.push_back(rhs[byte]);
-  }
+  const std::string_view str(rhs);
+  lhs.insert(lhs.end(), str.begin(), str.end());
   return lhs;
 }
 
 template <typename T>
 void npy_save(const std::string_view fname, const T *data,
               const std::vector<size_t> &shape,
-              const std::string_view mode = "w") {
-  FILE *fp = nullptr;
+              const std::string_view mode = "w",
+              const bool fortran_order = false) {
+  file_ptr fp;
   std::vector<size_t>
       true_data_shape; // if appending, the shape of existing + new data
+  size_t old_header_size = 0;
 
   if (mode == "a") {
-    fp = fopen(fname.data(), "r+b");
+    fp.reset(fopen(fname.data(), "r+b"));
   }
 
   if (fp) {
     // file exists. we need to append to it. read the header, modify the array
     // size
     size_t word_size;
-    bool fortran_order;
-    parse_npy_header(fp, word_size, true_data_shape, fortran_order);
-    assert(!fortran_order);
+    bool file_fortran_order;
+    parse_npy_header(fp.get(), word_size, true_data_shape, file_fortran_order);
+    old_header_size = static_cast<size_t>(ftell(fp.get()));
+
+    if (file_fortran_order != fortran_order) {
+      throw std::runtime_error(
+          "npy_save: cannot append " +
+          std::string(fortran_order ? "fortran" : "C") + " order data to " +
+          std::string(fname));
+    }
+    if (shape.empty() || true_data_shape.empty()) {
+      throw std::runtime_error("npy_save: cannot append to 0-d array " +
+                               std::string(fname));
+    }
 
     if (word_size != sizeof(T)) {
-      std::cout << "libnpy error: " << fname << " has word size " << word_size
-                << " but npy_save appending data sized " << sizeof(T) << "\n";
+      throw std::runtime_error("npy_save: " + std::string(fname) +
+                               " has word size " + std::to_string(word_size) +
+                               " but the appended data " +
+                               std::to_string(sizeof(T)));
     }
     if (true_data_shape.size() != shape.size()) {
-      std::cout << "libnpy error: npy_save attempting to append misdimensioned "
-                   "data to "
-                << fname << "\n";
+      throw std::runtime_error(
+          "npy_save: attempting to append misdimensioned data to " +
+          std::string(fname));
     }
 
-    for (size_t i = 1; i < shape.size(); i++) {
-      if (shape[i] != true_data_shape[i]) {
-        std::cout
-            << "libnpy error: npy_save attempting to append misshaped data to "
-            << fname << "\n";
+    // C order arrays grow along the first axis, fortran order arrays along
+    // the last one. either way the new data goes to the end of the file
+    const size_t axis = fortran_order ? shape.size() - 1 : 0;
+    for (size_t i = 0; i < shape.size(); i++) {
+      if (i != axis && shape[i] != true_data_shape[i]) {
+        throw std::runtime_error(
+            "npy_save: attempting to append misshaped data to " +
+            std::string(fname));
       }
     }
-    true_data_shape[0] += shape[0];
+    true_data_shape[axis] += shape[axis];
   } else {
-    fp = fopen(fname.data(), "wb");
+    fp.reset(fopen(fname.data(), "wb"));
     true_data_shape = shape;
   }
 
-  std::vector<char> header = create_npy_header<T>(true_data_shape);
-  const size_t nels =
-      std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<size_t>());
+  if (!fp) {
+    throw std::runtime_error("npy_save: Unable to open file " +
+                             std::string(fname));
+  }
+
+  // the header is padded to its old size, so it only grows (and the data has to
+  // be moved) when the new shape does not fit into the old padding
+  std::vector<char> header =
+      create_npy_header<T>(true_data_shape, fortran_order, old_header_size);
+  const size_t nels = std::accumulate(shape.begin(), shape.end(), size_t{1},
+                                      std::multiplies<size_t>());
 
-  fseek(fp, 0, SEEK_SET);
-  fwrite(header.data(), sizeof(char), header.size(), fp);
-  fseek(fp, 0, SEEK_END);
-  fwrite(data, sizeof(T), nels, fp);
-  fclose(fp);
+  if (old_header_size != 0 && header.size() > old_header_size) {
+    grow_npy_header(fp.get(), old_header_size, header.size());
+  }
+  fseek(fp.get(), 0, SEEK_SET);
+  fwrite(header.data(), sizeof(char), header.size(), fp.get());
+  fseek(fp.get(), 0, SEEK_END);
+  // data may be null for zero-length arrays
+  if (nels > 0) {
+    fwrite(data, sizeof(T), nels, fp.get());
+  }
+}
+
+template <typename T, size_t Rank>
+void npy_save(const std::string_view fname, const T *data,
+              const std::array<size_t, Rank> &shape,
+              const std::string_view mode = "w",
+              const bool fortran_order = false) {
+  if (mode == "a") {
+    npy_save(fname, data, std::vector<size_t>(shape.begin(), shape.end()),
+             mode, fortran_order);
+    return;
+  }
+
+  file_ptr fp(fopen(fname.data(), "wb"));
+  if (!fp) {
+    throw std::runtime_error("npy_save: Unable to open file " +
+                             std::string(fname));
+  }
+
+  const npy_header<T, Rank> header(shape, fortran_order);
+  const size_t nels = std::accumulate(shape.begin(), shape.end(), size_t{1},
+                                      std::multiplies<size_t>());
+
+  fwrite(header.data(), sizeof(char), header.size(), fp.get());
+  if (nels > 0) {
+    fwrite(data, sizeof(T), nels, fp.get());
+  }
 }
 
 template <typename T>
 void npz_save(const std::string_view zipname, std::string fname, const T *data,
               const std::vector<size_t> &shape,
-              const std::string_view mode = "w") {
+              const std::string_view mode = "w",
+              const bool fortran_order = false,
+              const compression method = compression::none,
+              const std::vector<filter> &filters = {}) {
   // first, append a .npy to the fname
   fname += ".npy";
 
-  // now, on with the show
-  FILE *fp = nullptr;
+  std::vector<char> npy_header = create_npy_header<T>(shape, fortran_order);
+
+  size_t nels = std::accumulate(shape.begin(), shape.end(), size_t{1},
+                                std::multiplies<size_t>());
+  size_t nbytes = nels * sizeof(T) + npy_header.size();
+
+  std::vector<char> filtered;
+  const void *member_data = data;
+  std::vector<char> extra_field;
+  if (!filters.empty()) {
+    // data may be null for zero-length arrays
+    if (nels > 0) {
+      filtered = filter_npz_data(filters, data, nels * sizeof(T), sizeof(T));
+      member_data = filtered.data();
+    }
+
+    extra_field += npz_filter_extra_id;
+    extra_field += static_cast<uint16_t>(1 + filters.size());
+    extra_field += static_cast<uint8_t>(filters.size());
+    for (const filter f : filters) {
+      extra_field += static_cast<uint8_t>(f);
+    }
+  }
+
+  // get the CRC of the data to be added
+  uint32_t crc = crc32(0L, reinterpret_cast<uint8_t *>(npy_header.data()),
+                       npy_header.size());
+  // crc32 with a null buffer returns the initial value instead of crc
+  if (nels > 0) {
+    crc = crc32(crc, static_cast<const uint8_t *>(member_data),
+                nels * sizeof(T));
+  }
+
+  std::vector<char> compressed;
+  if (method != compression::none) {
+    compressed =
+        compress_npz_member(method, npy_header.data(), npy_header.size(),
+                            member_data, nels * sizeof(T));
+  }
+  const size_t compr_bytes =
+      method == compression::none ? nbytes : compressed.size();
+
+  // the member is built completely before the archive is opened, so a
+  // failure above leaves an existing file untouched
+  file_ptr fp;
   uint16_t nrecs = 0;
   size_t global_header_offset = 0;
   std::vector<char> global_header;
 
   if (mode == "a") {
-    fp = fopen(zipname.data(), "r+b");
+    fp.reset(fopen(zipname.data(), "r+b"));
   }
 
   if (fp) {
@@ -239,47 +693,44 @@ void npz_save(const std::string_view zipname, std::string fname, const T *data,
     // the new data at the start of the global header then append the global
     // header and footer below it
     size_t global_header_size;
-    parse_zip_footer(fp, nrecs, global_header_size, global_header_offset);
-    fseek(fp, global_header_offset, SEEK_SET);
+    parse_zip_footer(fp.get(), nrecs, global_header_size, global_header_offset);
+    fseek(fp.get(), global_header_offset, SEEK_SET);
     global_header.resize(global_header_size);
     size_t res =
-        fread(global_header.data(), sizeof(char), global_header_size, fp);
+        fread(global_header.data(), sizeof(char), global_header_size, fp.get());
     if (res != global_header_size) {
       throw std::runtime_error(
           "npz_save: header read error while adding to existing zip");
     }
-    fseek(fp, global_header_offset, SEEK_SET);
+    fseek(fp.get(), global_header_offset, SEEK_SET);
   } else {
-    fp = fopen(zipname.data(), "wb");
+    fp.reset(fopen(zipname.data(), "wb"));
   }
 
-  std::vector<char> npy_header = create_npy_header<T>(shape);
-
-  size_t nels =
-      std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<size_t>());
-  size_t nbytes = nels * sizeof(T) + npy_header.size();
-
-  // get the CRC of the data to be added
-  uint32_t crc = crc32(0L, reinterpret_cast<uint8_t *>(npy_header.data()),
-                       npy_header.size());
-  crc = crc32(crc, reinterpret_cast<const uint8_t *>(data), nels * sizeof(T));
+  if (!fp) {
+    throw std::runtime_error("npz_save: Unable to open file " +
+                             std::string(zipname));
+  }
 
   // clang-format off
   // build the local header
   std::vector<char> local_header;
   local_header += "PK";                   // first part of sig
   local_header += static_cast<uint16_t>(0x0403);       // second part of sig
-  local_header += static_cast<uint16_t>(20);           // min version to extract
+  local_header += static_cast<uint16_t>(
+      method == compression::zstd ? 63 : 20);          // min version to extract
   local_header += static_cast<uint16_t>(0);            // general purpose bit flag
-  local_header += static_cast<uint16_t>(0);            // compression method
+  local_header += static_cast<uint16_t>(method);       // compression method
   local_header += static_cast<uint16_t>(0);            // file last mod time
   local_header += static_cast<uint16_t>(0);            // file last mod date
   local_header += static_cast<uint32_t>(crc);          // crc
-  local_header += static_cast<uint32_t>(nbytes);       // compressed size
+  local_header += static_cast<uint32_t>(compr_bytes);  // compressed size
   local_header += static_cast<uint32_t>(nbytes);       // uncompressed size
   local_header += static_cast<uint16_t>(fname.size()); // fname length
-  local_header += static_cast<uint16_t>(0);            // extra field length
+  local_header += static_cast<uint16_t>(extra_field.size()); // extra field len
   local_header += fname;
+  local_header.insert(local_header.end(), extra_field.begin(),
+                      extra_field.end());
 
   // build global header
   global_header += "PK";             // first part of sig
@@ -295,6 +746,8 @@ void npz_save(const std::string_view zipname, std::string fname, const T *data,
       global_header_offset); // relative offset of local file header, since it
                             // begins where the global header used to begin
   global_header += fname;
+  global_header.insert(global_header.end(), extra_field.begin(),
+                       extra_field.end());
 
   // build footer
   std::vector<char> footer;
@@ -306,7 +759,7 @@ void npz_save(const std::string_view zipname, std::string fname, const T *data,
   footer += static_cast<uint16_t>(nrecs + 1);          // total number of records
   footer += static_cast<uint32_t>(global_header.size()); // nbytes of global headers
   footer += static_cast<uint32_t>(
-      global_header_offset + nbytes +
+      global_header_offset + compr_bytes +
       local_header.size()); // offset of start of global
                                              // headers, since global header now
                                              // starts after newly written array
@@ -314,12 +767,17 @@ void npz_save(const std::string_view zipname, std::string fname, const T *data,
   // clang-format on
 
   // write everything
-  fwrite(local_header.data(), sizeof(char), local_header.size(), fp);
-  fwrite(npy_header.data(), sizeof(char), npy_header.size(), fp);
-  fwrite(data, sizeof(T), nels, fp);
-  fwrite(global_header.data(), sizeof(char), global_header.size(), fp);
-  fwrite(footer.data(), sizeof(char), footer.size(), fp);
-  fclose(fp);
+  fwrite(local_header.data(), sizeof(char), local_header.size(), fp.get());
+  if (method == compression::none) {
+    fwrite(npy_header.data(), sizeof(char), npy_header.size(), fp.get());
+    if (nels > 0) {
+      fwrite(member_data, sizeof(T), nels, fp.get());
+    }
+  } else {
+    fwrite(compressed.data(), sizeof(char), compressed.size(), fp.get());
+  }
+  fwrite(global_header.data(), sizeof(char), global_header.size(), fp.get());
+  fwrite(footer.data(), sizeof(char), footer.size(), fp.get());
 }
 
 template <typename T>
@@ -332,44 +790,338 @@ void npy_save(const std::string_view fname, const std::vector<T> data,
 
 template <typename T>
 void npz_save(const std::string_view zipname, const std::string_view fname,
-              const std::vector<T> data, const std::string_view mode = "w") {
+              const std::vector<T> data, const std::string_view mode = "w",
+              const compression method = compression::none,
+              const std::vector<filter> &filters = {}) {
   std::vector<size_t> shape;
   shape.push_back(data.size());
-  npz_save(zipname, fname, data.data(), shape, mode);
+  npz_save(zipname, std::string(fname), data.data(), shape, mode, false, method,
+           filters);
 }
 
+// size of the stdio buffer every batch worker reuses for its files. small
+// arrays fit into it completely, so they are read/written with one syscall
+constexpr size_t batch_io_buffer_size = 1 << 16;
+
+struct batch_status {
+  bool ok = false;
+  std::string error;
+};
+
+struct batch_load_result {
+  npy_array array;
+  batch_status status;
+};
+
+template <typename T> struct npy_save_item {
+  std::string fname;
+  const T *data;
+  std::vector<size_t> shape;
+  bool fortran_order = false;
+};
+
+// calls fn(worker, index) for every index in [0, count), distributed over
+// num_threads workers (0 means one per hardware thread)
+template <typename F>
+void run_batch(const size_t count, size_t num_threads, F &&fn) {
+  if (num_threads == 0) {
+    num_threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  num_threads = std::min(num_threads, count);
+
+  std::atomic<size_t> next = 0;
+  auto work = [&](const size_t worker) {
+    for (size_t i = next++; i < count; i = next++) {
+      fn(worker, i);
+    }
+  };
+
+  // joins the started workers on every exit, also when fn throws on this
+  // thread, so no joinable thread is ever destroyed
+  struct join_guard {
+    std::vector<std::thread> &threads;
+    ~join_guard() {
+      for (std::thread &thread : threads) {
+        thread.join();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(num_threads);
+  const join_guard guard{threads};
+  for (size_t worker = 1; worker < num_threads; worker++) {
+    try {
+      threads.emplace_back(work, worker);
+    } catch (const std::system_error &) {
+      // no more threads available, the items are handed out dynamically, so
+      // the workers started so far and this thread process the rest
+      break;
+    }
+  }
+  if (num_threads > 0) {
+    work(0);
+  }
+}
+
+// saves every item as its own .npy file (mode "w") and reports failures per
+// item instead of throwing
 template <typename T>
-std::vector<char> create_npy_header(const std::vector<size_t> &shape) {
-
-  std::vector<char> dict;
-  dict += "{'descr': '";
-  dict += get_endianness();
-  dict += map_type<T>();
-  dict += std::to_string(sizeof(T));
-  dict += "', 'fortran_order': False, 'shape': (";
-  dict += std::to_string(shape[0]);
-  for (size_t i = 1; i < shape.size(); i++) {
-    dict += ", ";
-    dict += std::to_string(shape[i]);
-  }
-  if (shape.size() == 1) {
-    dict += ",";
-  }
-  dict += "), }";
-  // pad with spaces so that preamble+dict is modulo 16 bytes. preamble is 10
-  // bytes. dict needs to end with \n
-  const int remainder = 16 - (10 + dict.size()) % 16;
-  dict.insert(dict.end(), remainder, ' ');
-  dict.back() = '\n';
-
-  std::vector<char> header;
-  header += static_cast<char>(0x93);
-  header += "NUMPY";
-  header += static_cast<char>(0x01); // major version of numpy format
-  header += static_cast<char>(0x00); // minor version of numpy format
-  header += static_cast<uint16_t>(dict.size());
-  header.insert(header.end(), dict.begin(), dict.end());
+std::vector<batch_status>
+npy_save_batch(const std::vector<npy_save_item<T>> &items,
+               const size_t num_threads = 0) {
+  struct scratch {
+    std::vector<char> header;
+    std::vector<char> io_buffer;
+  };
+
+  std::vector<batch_status> results(items.size());
+  std::vector<scratch> workers(
+      num_threads == 0 ? std::max(1U, std::thread::hardware_concurrency())
+                       : num_threads);
+
+  run_batch(items.size(), workers.size(), [&](const size_t worker,
+                                              const size_t i) {
+    const npy_save_item<T> &item = items[i];
+    batch_status &status = results[i];
+    scratch &buffers = workers[worker];
+
+    try {
+      file_ptr fp(fopen(item.fname.c_str(), "wb"));
+      if (!fp) {
+        status.error = "npy_save_batch: Unable to open file " + item.fname;
+        return;
+      }
+
+      buffers.io_buffer.resize(batch_io_buffer_size);
+      setvbuf(fp.get(), buffers.io_buffer.data(), _IOFBF,
+              buffers.io_buffer.size());
+
+      buffers.header.resize(npy_header_capacity<T>(item.shape.size()));
+      const size_t header_size =
+          write_npy_header<T>(buffers.header.data(), item.shape.data(),
+                              item.shape.size(), item.fortran_order);
+      const size_t nels =
+          std::accumulate(item.shape.begin(), item.shape.end(), size_t{1},
+                          std::multiplies<size_t>());
+
+      const bool written =
+          fwrite(buffers.header.data(), sizeof(char), header_size, fp.get()) ==
+              header_size &&
+          (nels == 0 || fwrite(item.data, sizeof(T), nels, fp.get()) == nels);
+      if (fclose(fp.release()) != 0 || !written) {
+        status.error = "npy_save_batch: failed fwrite to " + item.fname;
+        return;
+      }
+      status.ok = true;
+    } catch (const std::exception &e) {
+      status.error = e.what();
+    }
+  });
+
+  return results;
+}
+
+// loads every file as .npy and reports failures per file instead of throwing
+std::vector<batch_load_result>
+npy_load_batch(const std::vector<std::string> &fnames, size_t num_threads = 0);
+
+// one .npy file of a sharded array, holding the global rows [begin, end)
+struct shard_info {
+  std::string fname;
+  size_t begin;
+  size_t end;
+};
+
+// writes the index of a sharded array. shard file names are stored relative
+// to the directory of the index file
+void write_shard_index(const std::string &index_fname, const std::string &descr,
+                       const std::vector<size_t> &row_shape,
+                       const std::vector<shard_info> &shards);
+
+// writes one logical array of shape {rows, row_shape...} as a series of .npy
+// shards <prefix>_00000.npy, <prefix>_00001.npy, ... of at most
+// max_shard_bytes each (but at least one row), and the index <prefix>.idx
+// listing them. the index is written by close(), or by the destructor
+template <typename T> class sharded_writer {
+public:
+  sharded_writer(std::string prefix, std::vector<size_t> row_shape,
+                 const size_t max_shard_bytes)
+      : prefix_(std::move(prefix)), row_shape_(std::move(row_shape)),
+        row_size_(std::accumulate(row_shape_.begin(), row_shape_.end(),
+                                  size_t{1}, std::multiplies<size_t>())),
+        rows_per_shard_(std::max<size_t>(
+            1, max_shard_bytes / std::max<size_t>(1, row_size_ * sizeof(T)))) {
+  }
+
+  sharded_writer(const sharded_writer &) = delete;
+  sharded_writer &operator=(const sharded_writer &) = delete;
+
+  ~sharded_writer() {
+    try {
+      close();
+    } catch (...) {
+      // destructors must not throw, call close() to see the error
+    }
+  }
+
+  // appends `rows` rows, rolling over to a new shard whenever the current
+  // one is full
+  void append(const T *data, size_t rows) {
+    if (closed_) {
+      throw std::runtime_error("sharded_writer: append after close");
+    }
+
+    while (rows > 0) {
+      if (shards_.empty() ||
+          shards_.back().end - shards_.back().begin == rows_per_shard_) {
+        shards_.push_back({shard_fname(shards_.size()), num_rows_, num_rows_});
+      }
+
+      shard_info &shard = shards_.back();
+      const size_t n =
+          std::min(rows, rows_per_shard_ - (shard.end - shard.begin));
+
+      std::vector<size_t> shape{n};
+      shape.insert(shape.end(), row_shape_.begin(), row_shape_.end());
+      npy_save(shard.fname, data, shape, shard.end == shard.begin ? "w" : "a");
+
+      shard.end += n;
+      num_rows_ += n;
+      data += n * row_size_;
+      rows -= n;
+    }
+  }
+
+  void close() {
+    if (closed_) {
+      return;
+    }
+    closed_ = true;
+
+    const std::string descr = std::string{get_endianness(), map_type<T>()} +
+                              std::to_string(sizeof(T));
+    write_shard_index(prefix_ + ".idx", descr, row_shape_, shards_);
+  }
+
+  [[nodiscard]] size_t num_rows() const noexcept { return num_rows_; }
+  [[nodiscard]] const std::vector<shard_info> &shards() const noexcept {
+    return shards_;
+  }
 
+private:
+  [[nodiscard]] std::string shard_fname(const size_t shard) const {
+    std::string number = std::to_string(shard);
+    if (number.size() < 5) {
+      number.insert(0, 5 - number.size(), '0');
+    }
+    return prefix_ + "_" + number + ".npy";
+  }
+
+  std::string prefix_;
+  std::vector<size_t> row_shape_;
+  size_t row_size_;
+  size_t rows_per_shard_;
+  std::vector<shard_info> shards_;
+  size_t num_rows_ = 0;
+  bool closed_ = false;
+};
+
+// presents the shards listed in an index written by sharded_writer as one
+// array of shape {num_rows, row_shape...}
+class sharded_reader {
+public:
+  explicit sharded_reader(const std::string &index_fname);
+
+  // reads the global rows [begin, end), the shards involved are read in
+  // parallel on num_threads workers (0 means one per hardware thread)
+  [[nodiscard]] npy_array read_rows(size_t begin, size_t end,
+                                    size_t num_threads = 0) const;
+
+  [[nodiscard]] size_t num_rows() const noexcept { return num_rows_; }
+  [[nodiscard]] size_t word_size() const noexcept { return word_size_; }
+  [[nodiscard]] const std::string &descr() const noexcept { return descr_; }
+  [[nodiscard]] std::vector<size_t> shape() const {
+    std::vector<size_t> shape{num_rows_};
+    shape.insert(shape.end(), row_shape_.begin(), row_shape_.end());
+    return shape;
+  }
+  [[nodiscard]] const std::vector<shard_info> &shards() const noexcept {
+    return shards_;
+  }
+
+private:
+  std::vector<shard_info> shards_;
+  std::vector<size_t> row_shape_;
+  std::string descr_;
+  size_t word_size_ = 0;
+  size_t num_rows_ = 0;
+};
+
+struct cache_stats {
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t evictions = 0;
+  size_t num_arrays = 0;
+  size_t num_bytes = 0;
+};
+
+// thread-safe LRU cache for loaded arrays, bounded by the total number of
+// bytes held. entries are keyed on file name and member and are reloaded when
+// the mtime or size of the file changes. concurrent requests for an array
+// that is being loaded wait for that load instead of reading the file again.
+// the returned arrays share their buffer with the cache, so they must not be
+// modified
+class array_cache {
+public:
+  explicit array_cache(const size_t max_bytes) : max_bytes_(max_bytes) {}
+
+  array_cache(const array_cache &) = delete;
+  array_cache &operator=(const array_cache &) = delete;
+
+  npy_array npy_load(const std::string &fname);
+  npy_array npz_load(const std::string &fname, const std::string &varname);
+
+  void set_max_bytes(size_t max_bytes);
+  void clear();
+  [[nodiscard]] cache_stats stats() const;
+
+private:
+  struct entry {
+    std::shared_future<npy_array> array;
+    std::filesystem::file_time_type mtime;
+    uintmax_t file_size = 0;
+    size_t num_bytes = 0;
+    bool ready = false;
+    std::list<std::string>::iterator lru;
+  };
+  using entry_map = std::unordered_map<std::string, std::shared_ptr<entry>>;
+
+  npy_array load(const std::string &fname, const std::string &varname);
+  void drop(entry_map::iterator it);
+  void evict();
+
+  mutable std::mutex mutex_;
+  entry_map entries_;
+  std::list<std::string> lru_; // ready entries, most recently used first
+  size_t max_bytes_;
+  size_t num_bytes_ = 0;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+  size_t evictions_ = 0;
+};
+
+// process-wide cache, initially bounded to 256 MiB
+array_cache &global_array_cache();
+
+template <typename T>
+std::vector<char> create_npy_header(const std::vector<size_t> &shape,
+                                    const bool fortran_order,
+                                    const size_t min_size) {
+  std::vector<char> header(
+      std::max(npy_header_capacity<T>(shape.size()), min_size));
+  header.resize(write_npy_header<T>(header.data(), shape.data(), shape.size(),
+                                    fortran_order, min_size));
   return header;
 }
 
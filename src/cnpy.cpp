@@ -5,145 +5,279 @@
 
 #include "../include/cnpy/cnpy.hpp"
 #include <array>
+#include <cerrno>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
-#include <regex>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <limits>
 #include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
 
-void cnpy::parse_npy_header(unsigned char *buffer, size_t &word_size,
-                            std::vector<size_t> &shape, bool &fortran_order) {
-  // std::string magic_string(buffer,6);
-  uint8_t major_version = *reinterpret_cast<uint8_t *>(buffer + 6);
-  uint8_t minor_version = *reinterpret_cast<uint8_t *>(buffer + 7);
-  const uint16_t header_len = *reinterpret_cast<uint16_t *>(buffer + 8);
-  std::string_view header(reinterpret_cast<char *>(buffer + 9), header_len);
-
-  // fortran order
-  const size_t fortran_order_start = header.find("fortran_order") + 16;
-  fortran_order = header.substr(fortran_order_start, 4) == "True";
-
-  // shape
-  const size_t shape_start = header.find('(');
-  const size_t shape_end = header.find(')');
-
-  const std::regex num_regex("[0-9][0-9]*");
-  std::smatch sm;
-  shape.clear();
+#ifdef CNPY_WITH_ZSTD
+#include <zstd.h>
+#endif
 
-  auto str_shape =
-      std::string(header.substr(shape_start + 1, shape_end - shape_start - 1));
-  while (std::regex_search(str_shape, sm, num_regex)) {
-    shape.push_back(std::stoi(sm[0].str()));
-    str_shape = sm.suffix().str();
-  }
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-  // endian, word size, data type
-  // byte order code | stands for not applicable.
-  // not sure when this applies except for byte array
-  const size_t endian_offset = header.find("descr") + 9;
-  const bool little_endian =
-      header[endian_offset] == '<' || header[endian_offset] == '|';
-  assert(little_endian);
+namespace {
 
-  // char type = header[loc1+1];
-  // assert(type == map_type(T));
+// largest npy header accepted. numpy only writes headers of a few hundred
+// bytes, and refuses to load headers above 10000 bytes by default
+constexpr size_t max_npy_header_size = 1 << 20;
 
-  std::string_view str_ws = header.substr(endian_offset + 2);
-  const size_t word_size_offset = str_ws.find('\'');
-  word_size = atoi(str_ws.substr(0, word_size_offset).data());
+// size of preamble + dict of the npy header starting with the given bytes
+uint64_t npy_header_size(const unsigned char *buffer, const size_t size) {
+  if (size < 12 || buffer[0] != 0x93 ||
+      std::memcmp(buffer + 1, "NUMPY", 5) != 0) {
+    throw std::runtime_error("parse_npy_header: not an npy file");
+  }
+  // version 1.0 stores the header length in 2 bytes, 2.0 and 3.0 in 4 bytes
+  const uint8_t major_version = buffer[6];
+  if (major_version < 1 || major_version > 3) {
+    throw std::runtime_error("parse_npy_header: unsupported version " +
+                             std::to_string(major_version));
+  }
+  // in 64 bit, so a v2/v3 length near 4 GiB cannot wrap around
+  const uint64_t preamble_len = major_version == 1 ? 10 : 12;
+  const uint64_t header_size =
+      preamble_len + (major_version == 1
+                          ? uint64_t{cnpy::read_le<uint16_t>(buffer + 8)}
+                          : uint64_t{cnpy::read_le<uint32_t>(buffer + 8)});
+  if (header_size > max_npy_header_size) {
+    throw std::runtime_error("parse_npy_header: header too large");
+  }
+  return header_size;
 }
 
-void cnpy::parse_npy_header(FILE *fp, size_t &word_size,
-                            std::vector<size_t> &shape, bool &fortran_order) {
-  std::array<char, 256> buffer;
-  if (const size_t res = fread(buffer.data(), sizeof(char), 11, fp);
-      res != 11) {
-    throw std::runtime_error("parse_npy_header: failed fread");
+std::string_view trim(std::string_view str) {
+  const size_t begin = str.find_first_not_of(' ');
+  if (begin == std::string_view::npos) {
+    return {};
   }
-  std::string header = fgets(buffer.data(), 256, fp);
-  assert(header[header.size() - 1] == '\n');
+  return str.substr(begin, str.find_last_not_of(' ') - begin + 1);
+}
 
-  // fortran order
-  size_t fortran_order_start = header.find("fortran_order");
-  // TODO: can be simplified in C++23 with std::string::contains
-  if (fortran_order_start == std::string::npos) {
+// value of key in the header dict, a tuple or everything up to the next ','
+// or '}'
+std::string_view dict_value(const std::string_view dict,
+                            const std::string_view key) {
+  size_t pos = dict.find(key);
+  if (pos == std::string_view::npos) {
     throw std::runtime_error(
-        "parse_npy_header: failed to find header keyword: 'fortran_order'");
+        "parse_npy_header: failed to find header keyword: " +
+        std::string(key));
   }
-  fortran_order_start += 16;
-  fortran_order = header.substr(fortran_order_start, 4) == "True";
-
-  // shape
-  const size_t shape_start = header.find('(');
-  const size_t shape_end = header.find(')');
-  if (shape_start == std::string::npos || shape_end == std::string::npos) {
-    throw std::runtime_error(
-        "parse_npy_header: failed to find header keyword: '(' or ')'");
+  pos = dict.find_first_not_of(' ', pos + key.size());
+  if (pos == std::string_view::npos || dict[pos] != ':') {
+    throw std::runtime_error("parse_npy_header: malformed value of " +
+                             std::string(key));
+  }
+  pos = dict.find_first_not_of(' ', pos + 1);
+  const size_t end = pos == std::string_view::npos ? pos
+                     : dict[pos] == '('
+                         ? dict.find(')', pos) + 1
+                         : dict.find_first_of(",}", pos);
+  if (end == std::string_view::npos || end == 0) {
+    throw std::runtime_error("parse_npy_header: malformed value of " +
+                             std::string(key));
   }
+  return trim(dict.substr(pos, end - pos));
+}
 
-  const std::regex num_regex("[0-9][0-9]*");
-  std::smatch sm;
-  shape.clear();
+size_t parse_size(const std::string_view str) {
+  size_t value = 0;
+  const auto [ptr, ec] =
+      std::from_chars(str.data(), str.data() + str.size(), value);
+  // python 2 wrote long integers with an L suffix
+  if (ec != std::errc() || str.empty() ||
+      (ptr != str.data() + str.size() &&
+       std::string_view(ptr, str.data() + str.size() - ptr) != "L")) {
+    throw std::runtime_error("parse_npy_header: invalid number '" +
+                             std::string(str) + "'");
+  }
+  return value;
+}
 
-  std::string str_shape =
-      header.substr(shape_start + 1, shape_end - shape_start - 1);
-  while (std::regex_search(str_shape, sm, num_regex)) {
-    shape.push_back(std::stoi(sm[0].str()));
-    str_shape = sm.suffix().str();
+void parse_npy_dict(const std::string_view dict, size_t &word_size,
+                    std::vector<size_t> &shape, bool &fortran_order) {
+  const std::string_view order = dict_value(dict, "'fortran_order'");
+  if (order != "True" && order != "False") {
+    throw std::runtime_error("parse_npy_header: invalid fortran_order");
   }
+  fortran_order = order == "True";
 
-  // endian, word size, data type
-  // byte order code | stands for not applicable.
-  // not sure when this applies except for byte array
-  size_t endian_offset = header.find("descr");
-  if (endian_offset == std::string::npos) {
+  // e.g. '<f8'. byte order code | stands for not applicable
+  std::string_view descr = dict_value(dict, "'descr'");
+  if (descr.size() < 5 || descr.front() != '\'' || descr.back() != '\'') {
+    throw std::runtime_error("parse_npy_header: unsupported descr " +
+                             std::string(descr));
+  }
+  descr = descr.substr(1, descr.size() - 2);
+  if (descr[0] != '<' && descr[0] != '|') {
     throw std::runtime_error(
-        "parse_npy_header: failed to find header keyword: 'descr'");
+        "parse_npy_header: only little endian data is supported");
+  }
+  word_size = parse_size(descr.substr(2));
+
+  const std::string_view str_shape = dict_value(dict, "'shape'");
+  if (str_shape.size() < 2 || str_shape.front() != '(' ||
+      str_shape.back() != ')') {
+    throw std::runtime_error("parse_npy_header: invalid shape " +
+                             std::string(str_shape));
+  }
+  shape.clear();
+  std::string_view dims = str_shape.substr(1, str_shape.size() - 2);
+  // the number of bytes has to fit into size_t
+  size_t max_dim = word_size == 0 ? std::numeric_limits<size_t>::max()
+                                  : std::numeric_limits<size_t>::max() /
+                                        word_size;
+  while (!trim(dims).empty()) {
+    const size_t comma = dims.find(',');
+    const size_t dim = parse_size(trim(dims.substr(0, comma)));
+    if (dim != 0 && dim > max_dim) {
+      throw std::runtime_error("parse_npy_header: array too large");
+    }
+    max_dim = dim == 0 ? max_dim : max_dim / dim;
+    shape.push_back(dim);
+    dims = comma == std::string_view::npos ? std::string_view()
+                                            : dims.substr(comma + 1);
   }
-  endian_offset += 9;
-  const bool little_endian =
-      header[endian_offset] == '<' || header[endian_offset] == '|';
-  assert(little_endian);
+}
+
+// the dtype of an npy header already checked by parse_npy_header, e.g. "<f8"
+std::string npy_descr(const unsigned char *buffer, const uint64_t header_size) {
+  const size_t preamble_len = buffer[6] == 1 ? 10 : 12;
+  const std::string_view descr = dict_value(
+      std::string_view(reinterpret_cast<const char *>(buffer) + preamble_len,
+                       header_size - preamble_len),
+      "'descr'");
+  return std::string(descr.substr(1, descr.size() - 2));
+}
 
-  // char type = header[loc1+1];
-  // assert(type == map_type(T));
+} // namespace
 
-  std::string str_ws = header.substr(endian_offset + 2);
-  const size_t word_site_offset = str_ws.find('\'');
-  word_size = atoi(str_ws.substr(0, word_site_offset).c_str());
+void cnpy::parse_npy_header(const unsigned char *buffer, const size_t size,
+                            size_t &word_size, std::vector<size_t> &shape,
+                            bool &fortran_order) {
+  const uint64_t header_size = npy_header_size(buffer, size);
+  const size_t preamble_len = buffer[6] == 1 ? 10 : 12;
+  if (header_size < preamble_len) {
+    throw std::runtime_error("parse_npy_header: invalid header length");
+  }
+  if (header_size > size) {
+    throw std::runtime_error("parse_npy_header: header is truncated");
+  }
+  parse_npy_dict(std::string_view(reinterpret_cast<const char *>(buffer) +
+                                      preamble_len,
+                                  header_size - preamble_len),
+                 word_size, shape, fortran_order);
+}
+
+void cnpy::parse_npy_header(FILE *fp, size_t &word_size,
+                            std::vector<size_t> &shape, bool &fortran_order) {
+  std::vector<unsigned char> buffer(12);
+  if (fread(buffer.data(), sizeof(char), buffer.size(), fp) != buffer.size()) {
+    throw std::runtime_error("parse_npy_header: failed fread");
+  }
+  buffer.resize(npy_header_size(buffer.data(), buffer.size()));
+  if (buffer.size() > 12 &&
+      fread(buffer.data() + 12, sizeof(char), buffer.size() - 12, fp) !=
+          buffer.size() - 12) {
+    throw std::runtime_error("parse_npy_header: failed fread");
+  }
+  parse_npy_header(buffer.data(), buffer.size(), word_size, shape,
+                   fortran_order);
 }
 
 void cnpy::parse_zip_footer(FILE *fp, uint16_t &nrecs,
                             size_t &global_header_size,
                             size_t &global_header_offset) {
-  std::vector<char> footer(22);
-  fseek(fp, -22, SEEK_END);
-  if (const size_t res = fread(footer.data(), sizeof(char), 22, fp);
-      res != 22) {
+  std::array<unsigned char, 22> footer{};
+  if (fseek(fp, -22, SEEK_END) != 0 ||
+      fread(footer.data(), sizeof(char), footer.size(), fp) != footer.size()) {
     throw std::runtime_error("parse_zip_footer: failed fread");
   }
+  const auto footer_offset = static_cast<size_t>(ftell(fp)) - footer.size();
+
+  // archives with a comment are not supported, the record has to be last
+  if (std::memcmp(footer.data(), "PK\x05\x06", 4) != 0) {
+    throw std::runtime_error(
+        "parse_zip_footer: no end of central directory record");
+  }
+  const uint16_t disk_no = read_le<uint16_t>(footer.data() + 4);
+  const uint16_t disk_start = read_le<uint16_t>(footer.data() + 6);
+  const uint16_t nrecs_on_disk = read_le<uint16_t>(footer.data() + 8);
+  nrecs = read_le<uint16_t>(footer.data() + 10);
+  global_header_size = read_le<uint32_t>(footer.data() + 12);
+  global_header_offset = read_le<uint32_t>(footer.data() + 16);
+
+  if (disk_no != 0 || disk_start != 0 || nrecs_on_disk != nrecs) {
+    throw std::runtime_error(
+        "parse_zip_footer: multi-disk archives are not supported");
+  }
+  if (global_header_offset > footer_offset ||
+      global_header_size > footer_offset - global_header_offset) {
+    throw std::runtime_error("parse_zip_footer: corrupt central directory");
+  }
+}
+
+void cnpy::grow_npy_header(FILE *fp, const size_t old_size,
+                           const size_t new_size) {
+  fseek(fp, 0, SEEK_END);
+  const size_t file_size = static_cast<size_t>(ftell(fp));
+
+  // move the data back to front in chunks, so no chunk overwrites data that
+  // has not been moved yet
+  std::vector<char> chunk(1 << 20);
+  size_t end = file_size;
+  while (end > old_size) {
+    const size_t begin = std::max(old_size, end - std::min(end, chunk.size()));
+    const size_t nbytes = end - begin;
+    fseek(fp, static_cast<long>(begin), SEEK_SET);
+    if (fread(chunk.data(), sizeof(char), nbytes, fp) != nbytes) {
+      throw std::runtime_error("grow_npy_header: failed fread");
+    }
+    fseek(fp, static_cast<long>(begin + new_size - old_size), SEEK_SET);
+    if (fwrite(chunk.data(), sizeof(char), nbytes, fp) != nbytes) {
+      throw std::runtime_error("grow_npy_header: failed fwrite");
+    }
+    end = begin;
+  }
+}
 
-  const uint16_t disk_no = *reinterpret_cast<uint16_t *>(&footer[4]);
-  const uint16_t disk_start = *reinterpret_cast<uint16_t *>(&footer[6]);
-  const uint16_t nrecs_on_disk = *reinterpret_cast<uint16_t *>(&footer[8]);
-  nrecs = *reinterpret_cast<uint16_t *>(&footer[10]);
-  global_header_size = *reinterpret_cast<uint32_t *>(&footer[12]);
-  global_header_offset = *reinterpret_cast<uint32_t *>(&footer[16]);
-  const uint16_t comment_len = *reinterpret_cast<uint16_t *>(&footer[20]);
+namespace {
 
-  assert(disk_no == 0);
-  assert(disk_start == 0);
-  assert(nrecs_on_disk == nrecs);
-  assert(comment_len == 0);
+size_t array_bytes(const std::vector<size_t> &shape, const size_t word_size) {
+  // parse_npy_header made sure that this does not overflow
+  return std::accumulate(shape.begin(), shape.end(), word_size,
+                         std::multiplies<size_t>());
 }
 
+} // namespace
+
 cnpy::npy_array load_the_npy_file(FILE *fp) {
   std::vector<size_t> shape;
   size_t word_size;
   bool fortran_order;
   cnpy::parse_npy_header(fp, word_size, shape, fortran_order);
 
+  // check the size before allocating the array
+  const long data_offset = ftell(fp);
+  fseek(fp, 0, SEEK_END);
+  const long file_size = ftell(fp);
+  fseek(fp, data_offset, SEEK_SET);
+  if (data_offset < 0 || file_size < data_offset ||
+      array_bytes(shape, word_size) >
+          static_cast<size_t>(file_size - data_offset)) {
+    throw std::runtime_error("load_the_npy_file: file is truncated");
+  }
+
   cnpy::npy_array arr(shape, word_size, fortran_order);
   if (const size_t nread = fread(arr.data<char>(), 1, arr.num_bytes(), fp);
       nread != arr.num_bytes()) {
@@ -152,186 +286,1425 @@ cnpy::npy_array load_the_npy_file(FILE *fp) {
   return arr;
 }
 
-cnpy::npy_array load_the_npz_array(FILE *fp, const uint32_t compr_bytes,
-                                   const uint32_t uncompr_bytes) {
+namespace {
 
-  std::vector<unsigned char> buffer_compr(compr_bytes);
-  std::vector<unsigned char> buffer_uncompr(uncompr_bytes);
-  if (const size_t nread = fread(buffer_compr.data(), 1, compr_bytes, fp);
-      nread != compr_bytes) {
-    throw std::runtime_error("load_the_npy_file: failed fread");
+// size of the first read of an npy header, large enough for all headers
+// written by numpy for arrays of reasonable rank
+constexpr size_t npy_header_guess = 256;
+
+// contents of an npy header, parsed without allocating the array yet
+struct npy_header_info {
+  std::vector<size_t> shape;
+  std::string descr;
+  size_t word_size;
+  bool fortran_order;
+  // size of preamble + dict
+  uint64_t header_size;
+  uint64_t num_bytes;
+};
+
+// the npy header stored at offset of the file, followed by at most size bytes
+// of header and data
+npy_header_info read_npy_header(const cnpy::read_only_file &file,
+                                const uint64_t offset, const uint64_t size) {
+  std::vector<unsigned char> buffer(std::min<uint64_t>(size, npy_header_guess));
+  if (buffer.size() < 12) {
+    throw std::runtime_error("read_npy_header: file too short");
   }
+  file.read(buffer.data(), buffer.size(), offset);
 
-  z_stream d_stream;
+  npy_header_info info{};
+  info.header_size = npy_header_size(buffer.data(), buffer.size());
+  if (info.header_size > size) {
+    throw std::runtime_error("read_npy_header: file too short");
+  }
+  if (info.header_size > buffer.size()) {
+    buffer.resize(info.header_size);
+    file.read(buffer.data(), buffer.size(), offset);
+  }
 
-  d_stream.zalloc = nullptr;
-  d_stream.zfree = nullptr;
-  d_stream.opaque = nullptr;
-  d_stream.avail_in = 0;
-  d_stream.next_in = nullptr;
-  int err = inflateInit2(&d_stream, -MAX_WBITS);
+  cnpy::parse_npy_header(buffer.data(), buffer.size(), info.word_size,
+                         info.shape, info.fortran_order);
+  info.descr = npy_descr(buffer.data(), info.header_size);
+  info.num_bytes = array_bytes(info.shape, info.word_size);
+  if (info.num_bytes > size - info.header_size) {
+    throw std::runtime_error("read_npy_header: file too short for the shape");
+  }
+  return info;
+}
+
+// npy_array from an uncompressed member (npy header followed by the data)
+cnpy::npy_array array_from_buffer(const std::vector<unsigned char> &buffer) {
+  std::vector<size_t> shape;
+  size_t word_size;
+  bool fortran_order;
+  cnpy::parse_npy_header(buffer.data(), buffer.size(), word_size, shape,
+                         fortran_order);
 
-  d_stream.avail_in = compr_bytes;
-  d_stream.next_in = buffer_compr.data();
-  d_stream.avail_out = uncompr_bytes;
+  if (array_bytes(shape, word_size) >
+      buffer.size() - npy_header_size(buffer.data(), buffer.size())) {
+    throw std::runtime_error("npz_load: member too short for its shape");
+  }
+  cnpy::npy_array array(shape, word_size, fortran_order);
+
+  if (array.num_bytes() > 0) {
+    const size_t offset = buffer.size() - array.num_bytes();
+    memcpy(array.data<unsigned char>(), buffer.data() + offset,
+           array.num_bytes());
+  }
+
+  return array;
+}
+
+cnpy::npy_array inflate_npy(const std::vector<unsigned char> &buffer_compr,
+                            const uint64_t uncompr_bytes) {
+  std::vector<unsigned char> buffer_uncompr(uncompr_bytes);
+
+  z_stream d_stream{};
+  if (inflateInit2(&d_stream, -MAX_WBITS) != Z_OK) {
+    throw std::runtime_error("inflate_npy: inflateInit2 failed");
+  }
+
+  // zlib counts in 32 bit, so larger members are fed in chunks
+  constexpr uint64_t max_chunk = 1U << 30;
+  uint64_t in_left = buffer_compr.size();
+  uint64_t out_left = uncompr_bytes;
+  d_stream.next_in = const_cast<unsigned char *>(buffer_compr.data());
   d_stream.next_out = buffer_uncompr.data();
 
-  err = inflate(&d_stream, Z_FINISH);
-  err = inflateEnd(&d_stream);
+  int err = Z_OK;
+  while (err == Z_OK) {
+    if (d_stream.avail_in == 0) {
+      d_stream.avail_in = static_cast<uInt>(std::min(in_left, max_chunk));
+      in_left -= d_stream.avail_in;
+    }
+    if (d_stream.avail_out == 0) {
+      d_stream.avail_out = static_cast<uInt>(std::min(out_left, max_chunk));
+      out_left -= d_stream.avail_out;
+    }
+    // Z_BUF_ERROR when no progress is possible, i.e. truncated input or
+    // more output than uncompr_bytes
+    err = inflate(&d_stream, Z_NO_FLUSH);
+  }
+  inflateEnd(&d_stream);
+  if (err != Z_STREAM_END || d_stream.total_out != uncompr_bytes) {
+    throw std::runtime_error("inflate_npy: corrupt compressed data");
+  }
+
+  return array_from_buffer(buffer_uncompr);
+}
+
+std::vector<char> deflate_member(const char *header, const size_t header_size,
+                                 const void *data, const size_t nbytes) {
+  z_stream stream{};
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw std::runtime_error("npz_save: deflateInit2 failed");
+  }
+
+  std::vector<char> compressed(deflateBound(&stream, header_size + nbytes));
+  // zlib counts in 32 bit, so larger inputs are fed in chunks
+  constexpr size_t max_chunk = 1U << 30;
+  const std::array<std::pair<const char *, size_t>, 2> parts{
+      {{header, header_size}, {static_cast<const char *>(data), nbytes}}};
+
+  int err = Z_OK;
+  for (size_t part = 0; part < parts.size(); part++) {
+    const char *in = parts[part].first;
+    size_t left = parts[part].second;
+    do {
+      const size_t chunk = std::min(left, max_chunk);
+      stream.next_in =
+          reinterpret_cast<Bytef *>(const_cast<char *>(in));
+      stream.avail_in = static_cast<uInt>(chunk);
+      in += chunk;
+      left -= chunk;
+      const int flush =
+          part + 1 == parts.size() && left == 0 ? Z_FINISH : Z_NO_FLUSH;
+
+      do {
+        stream.next_out =
+            reinterpret_cast<Bytef *>(compressed.data() + stream.total_out);
+        stream.avail_out = static_cast<uInt>(
+            std::min(compressed.size() - stream.total_out, max_chunk));
+        err = deflate(&stream, flush);
+        if (err != Z_OK && err != Z_STREAM_END) {
+          deflateEnd(&stream);
+          throw std::runtime_error("npz_save: deflate failed");
+        }
+      } while (stream.avail_in > 0 ||
+               (flush == Z_FINISH && err != Z_STREAM_END));
+    } while (left > 0);
+  }
+
+  compressed.resize(stream.total_out);
+  deflateEnd(&stream);
+  return compressed;
+}
+
+void shuffle_scalar(const char *in, char *out, const size_t n,
+                    const size_t word_size, const size_t begin) {
+  for (size_t i = begin; i < n; i++) {
+    for (size_t byte = 0; byte < word_size; byte++) {
+      out[byte * n + i] = in[i * word_size + byte];
+    }
+  }
+}
+
+void unshuffle_scalar(const char *in, char *out, const size_t n,
+                      const size_t word_size, const size_t begin) {
+  for (size_t i = begin; i < n; i++) {
+    for (size_t byte = 0; byte < word_size; byte++) {
+      out[i * word_size + byte] = in[byte * n + i];
+    }
+  }
+}
+
+// bit k of the 16 bytes of every 16 byte chunk of a byte group ends up in
+// bit plane k, as one 16 bit little endian mask per chunk. the remaining
+// n % 16 bytes are copied after the 8 bit planes
+void bitshuffle_scalar(const unsigned char *in, unsigned char *out,
+                       const size_t n, const size_t begin) {
+  const size_t chunks = n / 16;
+  for (size_t c = begin; c < chunks; c++) {
+    for (size_t k = 0; k < 8; k++) {
+      unsigned mask = 0;
+      for (size_t i = 0; i < 16; i++) {
+        mask |= ((in[c * 16 + i] >> k) & 1U) << i;
+      }
+      out[(k * chunks + c) * 2] = static_cast<unsigned char>(mask);
+      out[(k * chunks + c) * 2 + 1] = static_cast<unsigned char>(mask >> 8);
+    }
+  }
+}
+
+void unbitshuffle_scalar(const unsigned char *in, unsigned char *out,
+                         const size_t n, const size_t begin) {
+  const size_t chunks = n / 16;
+  for (size_t c = begin; c < chunks; c++) {
+    for (size_t i = 0; i < 16; i++) {
+      unsigned char byte = 0;
+      for (size_t k = 0; k < 8; k++) {
+        const unsigned char mask = in[(k * chunks + c) * 2 + i / 8];
+        byte |= ((mask >> (i % 8)) & 1U) << k;
+      }
+      out[c * 16 + i] = byte;
+    }
+  }
+}
+
+#ifdef __SSE2__
+
+// one step of a byte transpose of word_size registers: interleaves the bytes
+// of every two registers whose index differs in bit k
+template <size_t W> void interleave_round(__m128i (&r)[W], const size_t k) {
+  const size_t bit = size_t{1} << k;
+  for (size_t j = 0; j < W; j++) {
+    if ((j & bit) == 0) {
+      const __m128i a = r[j];
+      const __m128i b = r[j | bit];
+      r[j] = _mm_unpacklo_epi8(a, b);
+      r[j | bit] = _mm_unpackhi_epi8(a, b);
+    }
+  }
+}
+
+// shuffles blocks of 16 elements, returns the number of elements done
+template <size_t W>
+size_t shuffle_sse2(const char *in, char *out, const size_t n) {
+  constexpr size_t bits = std::bit_width(W) - 1;
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i r[W];
+    for (size_t j = 0; j < W; j++) {
+      r[j] = _mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(in + i * W + 16 * j));
+    }
+    // every round moves one bit of the element index from the register
+    // index into the byte index, four rounds move all of them
+    for (size_t round = 0; round < 4; round++) {
+      interleave_round<W>(r, bits - 1 - round % bits);
+    }
+    for (size_t byte = 0; byte < W; byte++) {
+      // for 8 byte words the register index ends up as bits (0, 2, 1) of
+      // the byte index, for the other sizes it is the byte index
+      const size_t reg = W == 8 ? ((byte & 1) << 2) | ((byte >> 2) << 1) |
+                                      ((byte >> 1) & 1)
+                                : byte;
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + byte * n + i),
+                       r[reg]);
+    }
+  }
+  return i;
+}
+
+template <size_t W>
+size_t unshuffle_sse2(const char *in, char *out, const size_t n) {
+  constexpr size_t bits = std::bit_width(W) - 1;
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i r[W];
+    for (size_t byte = 0; byte < W; byte++) {
+      r[byte] = _mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(in + byte * n + i));
+    }
+    for (size_t round = 0; round < bits; round++) {
+      interleave_round<W>(r, bits - 1 - round);
+    }
+    for (size_t j = 0; j < W; j++) {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * W + 16 * j),
+                       r[j]);
+    }
+  }
+  return i;
+}
+
+size_t bitshuffle_sse2(const unsigned char *in, unsigned char *out,
+                       const size_t n) {
+  const size_t chunks = n / 16;
+  for (size_t c = 0; c < chunks; c++) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + c * 16));
+    // movemask takes the top bit of every byte, shifting 16 bit lanes moves
+    // the next bit of every byte to the top
+    for (size_t k = 8; k-- > 0;) {
+      const auto mask = static_cast<uint16_t>(_mm_movemask_epi8(x));
+      out[(k * chunks + c) * 2] = static_cast<unsigned char>(mask);
+      out[(k * chunks + c) * 2 + 1] = static_cast<unsigned char>(mask >> 8);
+      x = _mm_slli_epi16(x, 1);
+    }
+  }
+  return chunks;
+}
+
+size_t unbitshuffle_sse2(const unsigned char *in, unsigned char *out,
+                         const size_t n) {
+  const size_t chunks = n / 16;
+  const __m128i select = _mm_set1_epi64x(0x8040201008040201);
+  for (size_t c = 0; c < chunks; c++) {
+    __m128i x = _mm_setzero_si128();
+    for (size_t k = 0; k < 8; k++) {
+      // spread the 16 bits of the mask over 16 bytes, 0xff where set
+      const uint64_t lo = in[(k * chunks + c) * 2] * 0x0101010101010101ULL;
+      const uint64_t hi = in[(k * chunks + c) * 2 + 1] * 0x0101010101010101ULL;
+      const __m128i bytes = _mm_and_si128(
+          _mm_set_epi64x(static_cast<long long>(hi),
+                         static_cast<long long>(lo)),
+          select);
+      const __m128i set = _mm_cmpeq_epi8(bytes, select);
+      x = _mm_or_si128(
+          x, _mm_and_si128(set, _mm_set1_epi8(static_cast<char>(1U << k))));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + c * 16), x);
+  }
+  return chunks;
+}
+
+#endif
+
+void shuffle(const char *in, char *out, const size_t n,
+             const size_t word_size) {
+  size_t done = 0;
+#ifdef __SSE2__
+  switch (word_size) {
+  case 2:
+    done = shuffle_sse2<2>(in, out, n);
+    break;
+  case 4:
+    done = shuffle_sse2<4>(in, out, n);
+    break;
+  case 8:
+    done = shuffle_sse2<8>(in, out, n);
+    break;
+  case 16:
+    done = shuffle_sse2<16>(in, out, n);
+    break;
+  default:
+    break;
+  }
+#endif
+  shuffle_scalar(in, out, n, word_size, done);
+}
+
+void unshuffle(const char *in, char *out, const size_t n,
+               const size_t word_size) {
+  size_t done = 0;
+#ifdef __SSE2__
+  switch (word_size) {
+  case 2:
+    done = unshuffle_sse2<2>(in, out, n);
+    break;
+  case 4:
+    done = unshuffle_sse2<4>(in, out, n);
+    break;
+  case 8:
+    done = unshuffle_sse2<8>(in, out, n);
+    break;
+  case 16:
+    done = unshuffle_sse2<16>(in, out, n);
+    break;
+  default:
+    break;
+  }
+#endif
+  unshuffle_scalar(in, out, n, word_size, done);
+}
+
+// bit shuffles every byte group of n bytes separately
+void bitshuffle(const char *in, char *out, const size_t nbytes,
+                const size_t n) {
+  for (size_t group = 0; group < nbytes; group += n) {
+    const auto *src = reinterpret_cast<const unsigned char *>(in + group);
+    auto *dst = reinterpret_cast<unsigned char *>(out + group);
+    size_t done = 0;
+#ifdef __SSE2__
+    done = bitshuffle_sse2(src, dst, n);
+#endif
+    bitshuffle_scalar(src, dst, n, done);
+    std::memcpy(dst + n / 16 * 16, src + n / 16 * 16, n % 16);
+  }
+}
+
+void unbitshuffle(const char *in, char *out, const size_t nbytes,
+                  const size_t n) {
+  for (size_t group = 0; group < nbytes; group += n) {
+    const auto *src = reinterpret_cast<const unsigned char *>(in + group);
+    auto *dst = reinterpret_cast<unsigned char *>(out + group);
+    size_t done = 0;
+#ifdef __SSE2__
+    done = unbitshuffle_sse2(src, dst, n);
+#endif
+    unbitshuffle_scalar(src, dst, n, done);
+    std::memcpy(dst + n / 16 * 16, src + n / 16 * 16, n % 16);
+  }
+}
+
+template <typename U>
+void delta_encode(const char *in, char *out, const size_t n) {
+  U previous = 0;
+  for (size_t i = 0; i < n; i++) {
+    U value;
+    std::memcpy(&value, in + i * sizeof(U), sizeof(U));
+    const U diff = value - previous;
+    std::memcpy(out + i * sizeof(U), &diff, sizeof(U));
+    previous = value;
+  }
+}
+
+template <typename U>
+void delta_decode(const char *in, char *out, const size_t n) {
+  U value = 0;
+  for (size_t i = 0; i < n; i++) {
+    U diff;
+    std::memcpy(&diff, in + i * sizeof(U), sizeof(U));
+    value += diff;
+    std::memcpy(out + i * sizeof(U), &value, sizeof(U));
+  }
+}
+
+void delta(const char *in, char *out, const size_t n, const size_t word_size,
+           const bool encode) {
+  switch (word_size) {
+  case 1:
+    return encode ? delta_encode<uint8_t>(in, out, n)
+                  : delta_decode<uint8_t>(in, out, n);
+  case 2:
+    return encode ? delta_encode<uint16_t>(in, out, n)
+                  : delta_decode<uint16_t>(in, out, n);
+  case 4:
+    return encode ? delta_encode<uint32_t>(in, out, n)
+                  : delta_decode<uint32_t>(in, out, n);
+  case 8:
+    return encode ? delta_encode<uint64_t>(in, out, n)
+                  : delta_decode<uint64_t>(in, out, n);
+  default:
+    throw std::runtime_error("delta filter: unsupported word size " +
+                             std::to_string(word_size));
+  }
+}
+
+void apply_filter(const cnpy::filter f, const char *in, char *out,
+                  const size_t nbytes, const size_t word_size,
+                  const bool forward) {
+  const size_t n = nbytes / word_size;
+  switch (f) {
+  case cnpy::filter::shuffle:
+    return forward ? shuffle(in, out, n, word_size)
+                   : unshuffle(in, out, n, word_size);
+  case cnpy::filter::bitshuffle:
+    if (forward) {
+      std::vector<char> shuffled(nbytes);
+      shuffle(in, shuffled.data(), n, word_size);
+      return bitshuffle(shuffled.data(), out, nbytes, n);
+    } else {
+      std::vector<char> shuffled(nbytes);
+      unbitshuffle(in, shuffled.data(), nbytes, n);
+      return unshuffle(shuffled.data(), out, n, word_size);
+    }
+  case cnpy::filter::delta:
+    return delta(in, out, n, word_size, forward);
+  }
+  throw std::runtime_error("unsupported filter " +
+                           std::to_string(static_cast<int>(f)));
+}
+
+#ifdef CNPY_WITH_ZSTD
+
+// uncompressed size of every frame of a zstd member. frames are independent,
+// so they are compressed and decompressed in parallel
+constexpr size_t zstd_frame_size = 1 << 20;
+// zstd seekable format: the seek table is a skippable frame at the end
+constexpr uint32_t zstd_skippable_magic = 0x184D2A5E;
+constexpr uint32_t zstd_seekable_magic = 0x8F92EAB1;
+
+void append_le32(std::vector<char> &out, const uint32_t value) {
+  for (size_t byte = 0; byte < 4; byte++) {
+    out.push_back(static_cast<char>(value >> (8 * byte)));
+  }
+}
+
+std::vector<char> zstd_member(const char *header, const size_t header_size,
+                              const void *data, const size_t nbytes) {
+  const auto *array = static_cast<const char *>(data);
+  const size_t total = header_size + nbytes;
+  const size_t num_frames =
+      std::max<size_t>(1, (total + zstd_frame_size - 1) / zstd_frame_size);
+
+  std::vector<std::vector<char>> frames(num_frames);
+  std::vector<std::string> errors(num_frames);
+  cnpy::run_batch(num_frames, 0, [&](size_t, const size_t i) {
+    const size_t begin = i * zstd_frame_size;
+    const size_t size = std::min(total - begin, zstd_frame_size);
+
+    // only frames overlapping the npy header need to be assembled first
+    std::vector<char> assembled;
+    const char *src = array + (begin - std::min(begin, header_size));
+    if (begin < header_size) {
+      assembled.assign(header + begin, header + std::min(header_size,
+                                                         begin + size));
+      assembled.insert(assembled.end(), array,
+                       array + (size - assembled.size()));
+      src = assembled.data();
+    }
+
+    frames[i].resize(ZSTD_compressBound(size));
+    const size_t res = ZSTD_compress(frames[i].data(), frames[i].size(), src,
+                                     size, ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(res)) {
+      errors[i] = std::string("npz_save: ") + ZSTD_getErrorName(res);
+      return;
+    }
+    frames[i].resize(res);
+  });
+  for (const std::string &error : errors) {
+    if (!error.empty()) {
+      throw std::runtime_error(error);
+    }
+  }
+
+  std::vector<char> compressed;
+  for (const std::vector<char> &frame : frames) {
+    compressed.insert(compressed.end(), frame.begin(), frame.end());
+  }
+
+  append_le32(compressed, zstd_skippable_magic);
+  append_le32(compressed, static_cast<uint32_t>(num_frames * 8 + 9));
+  for (size_t i = 0; i < num_frames; i++) {
+    append_le32(compressed, static_cast<uint32_t>(frames[i].size()));
+    append_le32(compressed, static_cast<uint32_t>(
+                                std::min(total - i * zstd_frame_size,
+                                         zstd_frame_size)));
+  }
+  append_le32(compressed, static_cast<uint32_t>(num_frames));
+  compressed.push_back(0); // seek table descriptor: no checksums
+  append_le32(compressed, zstd_seekable_magic);
+
+  return compressed;
+}
+
+struct zstd_frame {
+  uint64_t compr_offset;
+  uint64_t compr_bytes;
+  uint64_t uncompr_offset;
+  uint64_t uncompr_bytes;
+};
+
+// frames listed in the seek table at the end of the member, empty if the
+// member was not written in the seekable format
+std::vector<zstd_frame>
+read_zstd_seek_table(const std::vector<unsigned char> &compressed,
+                     const uint64_t uncompr_bytes) {
+  const unsigned char *const end = compressed.data() + compressed.size();
+  if (compressed.size() < 17 ||
+      cnpy::read_le<uint32_t>(end - 4) != zstd_seekable_magic) {
+    return {};
+  }
+
+  const uint64_t num_frames = cnpy::read_le<uint32_t>(end - 9);
+  const size_t entry_size = (end[-5] & 0x80) != 0 ? 12 : 8;
+  const uint64_t table_size = num_frames * entry_size + 9;
+  if (table_size + 8 > compressed.size()) {
+    throw std::runtime_error("npz_load: corrupt zstd seek table");
+  }
+  const unsigned char *entry = end - table_size;
+  if (cnpy::read_le<uint32_t>(entry - 8) != zstd_skippable_magic ||
+      cnpy::read_le<uint32_t>(entry - 4) != table_size) {
+    throw std::runtime_error("npz_load: corrupt zstd seek table");
+  }
+
+  std::vector<zstd_frame> frames(num_frames);
+  uint64_t compr_offset = 0;
+  uint64_t uncompr_offset = 0;
+  for (zstd_frame &frame : frames) {
+    frame = {compr_offset, cnpy::read_le<uint32_t>(entry), uncompr_offset,
+             cnpy::read_le<uint32_t>(entry + 4)};
+    compr_offset += frame.compr_bytes;
+    uncompr_offset += frame.uncompr_bytes;
+    entry += entry_size;
+  }
+  if (compr_offset != compressed.size() - table_size - 8 ||
+      uncompr_offset != uncompr_bytes) {
+    throw std::runtime_error("npz_load: corrupt zstd seek table");
+  }
+  return frames;
+}
+
+void decompress_zstd_frame(void *dst, const size_t dst_size, const void *src,
+                           const size_t src_size) {
+  const size_t res = ZSTD_decompress(dst, dst_size, src, src_size);
+  if (ZSTD_isError(res) || res != dst_size) {
+    throw std::runtime_error("npz_load: corrupt zstd frame");
+  }
+}
+
+cnpy::npy_array
+zstd_decompress_npy(const std::vector<unsigned char> &compressed,
+                    const uint64_t uncompr_bytes) {
+  const std::vector<zstd_frame> frames =
+      read_zstd_seek_table(compressed, uncompr_bytes);
+
+  // the first frame has to hold the whole npy header to decompress the rest
+  // directly into the array
+  std::vector<unsigned char> first(frames.empty() ? uncompr_bytes
+                                                  : frames[0].uncompr_bytes);
+  if (frames.empty() || first.size() < 12) {
+    decompress_zstd_frame(first.data(), first.size(), compressed.data(),
+                          compressed.size());
+    return array_from_buffer(first);
+  }
+  decompress_zstd_frame(first.data(), first.size(), compressed.data(),
+                        frames[0].compr_bytes);
+  const uint64_t header_size = npy_header_size(first.data(), first.size());
+  if (header_size > first.size()) {
+    std::vector<unsigned char> buffer(uncompr_bytes);
+    decompress_zstd_frame(buffer.data(), buffer.size(), compressed.data(),
+                          frames.back().compr_offset +
+                              frames.back().compr_bytes);
+    return array_from_buffer(buffer);
+  }
 
   std::vector<size_t> shape;
   size_t word_size;
   bool fortran_order;
-  cnpy::parse_npy_header(buffer_uncompr.data(), word_size, shape,
+  cnpy::parse_npy_header(first.data(), first.size(), word_size, shape,
                          fortran_order);
-
+  if (array_bytes(shape, word_size) != uncompr_bytes - header_size) {
+    throw std::runtime_error("npz_load: member size does not match its shape");
+  }
   cnpy::npy_array array(shape, word_size, fortran_order);
 
-  const size_t offset = uncompr_bytes - array.num_bytes();
-  memcpy(array.data<unsigned char>(), buffer_uncompr.data() + offset,
-         array.num_bytes());
+  auto *const out = array.data<unsigned char>();
+  if (first.size() > header_size) {
+    std::memcpy(out, first.data() + header_size, first.size() - header_size);
+  }
+
+  std::vector<std::string> errors(frames.size());
+  cnpy::run_batch(frames.size() - 1, 0, [&](size_t, const size_t i) {
+    const zstd_frame &frame = frames[i + 1];
+    try {
+      decompress_zstd_frame(out + (frame.uncompr_offset - header_size),
+                            frame.uncompr_bytes,
+                            compressed.data() + frame.compr_offset,
+                            frame.compr_bytes);
+    } catch (const std::exception &e) {
+      errors[i] = e.what();
+    }
+  });
+  for (const std::string &error : errors) {
+    if (!error.empty()) {
+      throw std::runtime_error(error);
+    }
+  }
 
   return array;
 }
 
-cnpy::npz_t cnpy::npz_load(const std::string &fname) {
-  FILE *fp = fopen(fname.c_str(), "rb");
+#endif
+
+} // namespace
 
-  if (!fp) {
-    throw std::runtime_error("npz_load: Error! Unable to open file " + fname +
-                             "!");
+cnpy::read_only_file::read_only_file(const std::string &fname)
+    : fd_(open(fname.c_str(), O_RDONLY | O_CLOEXEC)) {
+  if (fd_ < 0) {
+    throw std::runtime_error("read_only_file: Unable to open file " + fname);
   }
 
-  cnpy::npz_t arrays;
+  struct stat st {};
+  if (fstat(fd_, &st) != 0) {
+    close(fd_);
+    throw std::runtime_error("read_only_file: Unable to stat file " + fname);
+  }
+  size_ = st.st_size;
+}
+
+cnpy::read_only_file::~read_only_file() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+cnpy::read_only_file::read_only_file(read_only_file &&other) noexcept
+    : fd_(std::exchange(other.fd_, -1)), size_(other.size_) {}
 
-  while (true) {
-    std::vector<char> local_header(30);
-    if (const size_t headerres =
-            fread(local_header.data(), sizeof(char), 30, fp);
-        headerres != 30) {
-      throw std::runtime_error("npz_load: failed fread");
+cnpy::read_only_file &
+cnpy::read_only_file::operator=(read_only_file &&other) noexcept {
+  if (this != &other) {
+    if (fd_ >= 0) {
+      close(fd_);
     }
+    fd_ = std::exchange(other.fd_, -1);
+    size_ = other.size_;
+  }
+  return *this;
+}
+
+void cnpy::read_only_file::read(void *out, size_t nbytes,
+                                uint64_t offset) const {
+  if (offset > size_ || nbytes > size_ - offset) {
+    throw std::runtime_error("read_only_file: read past the end of the file");
+  }
 
-    // if we've reached the global header, stop reading
-    if (local_header[2] != 0x03 || local_header[3] != 0x04) {
+  auto *dst = static_cast<char *>(out);
+  while (nbytes > 0) {
+    const ssize_t res = pread(fd_, dst, nbytes, static_cast<off_t>(offset));
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+    if (res <= 0) {
+      throw std::runtime_error("read_only_file: failed pread");
+    }
+    dst += res;
+    nbytes -= res;
+    offset += res;
+  }
+}
+
+void cnpy::read_only_file::advise_sequential() const noexcept {
+#if defined(POSIX_FADV_SEQUENTIAL)
+  posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+#elif defined(F_RDAHEAD)
+  fcntl(fd_, F_RDAHEAD, 1);
+#endif
+}
+
+cnpy::npy_file::npy_file(const std::string &fname)
+    : fname_(fname), file_(fname) {
+  const npy_header_info header = read_npy_header(file_, 0, file_.size());
+  shape_ = header.shape;
+  descr_ = header.descr;
+  word_size_ = header.word_size;
+  fortran_order_ = header.fortran_order;
+  data_offset_ = header.header_size;
+  num_bytes_ = header.num_bytes;
+}
+
+cnpy::npy_array cnpy::npy_file::load() const {
+  npy_array array(shape_, word_size_, fortran_order_);
+  file_.read(array.data<char>(), array.num_bytes(), data_offset_);
+  return array;
+}
+
+void cnpy::npy_file::read(void *out, const size_t nbytes,
+                          const uint64_t offset) const {
+  if (offset > num_bytes_ || nbytes > num_bytes_ - offset) {
+    throw std::runtime_error("npy_file: read past the end of the array in " +
+                             fname_);
+  }
+  file_.read(out, nbytes, data_offset_ + offset);
+}
+
+cnpy::npz_file::npz_file(const std::string &fname)
+    : fname_(fname), file_(fname) {
+  // the end of central directory record is the last thing in the file, only
+  // followed by a comment of up to 64 KiB
+  const uint64_t tail_size = std::min<uint64_t>(file_.size(), 22 + 0xffff);
+  std::vector<unsigned char> tail(tail_size);
+  file_.read(tail.data(), tail.size(), file_.size() - tail_size);
+
+  size_t eocd = std::string::npos;
+  for (size_t i = tail_size >= 22 ? tail_size - 22 + 1 : 0; i-- > 0;) {
+    if (std::memcmp(tail.data() + i, "PK\x05\x06", 4) == 0) {
+      eocd = i;
       break;
     }
+  }
+  if (eocd == std::string::npos) {
+    throw std::runtime_error("npz_file: " + fname + " is not a zip file");
+  }
+
+  uint64_t nrecs = read_le<uint16_t>(tail.data() + eocd + 10);
+  uint64_t global_header_size = read_le<uint32_t>(tail.data() + eocd + 12);
+  uint64_t global_header_offset = read_le<uint32_t>(tail.data() + eocd + 16);
 
-    // read in the variable name
-    const uint16_t name_len = *reinterpret_cast<uint16_t *>(&local_header[26]);
-    std::string varname(name_len, ' ');
-    if (const size_t vname_res =
-            fread(varname.data(), sizeof(char), name_len, fp);
-        vname_res != name_len) {
-      throw std::runtime_error("npz_load: failed fread");
+  if (nrecs == 0xffff || global_header_size == 0xffffffff ||
+      global_header_offset == 0xffffffff) {
+    // zip64, the real values are in the zip64 end of central directory
+    // record, which is found through the locator right before the footer
+    const uint64_t eocd_offset = file_.size() - tail_size + eocd;
+    std::array<unsigned char, 20> locator{};
+    std::array<unsigned char, 56> record{};
+    if (eocd_offset < locator.size()) {
+      throw std::runtime_error("npz_file: " + fname + " is corrupt");
+    }
+    file_.read(locator.data(), locator.size(), eocd_offset - locator.size());
+    if (std::memcmp(locator.data(), "PK\x06\x07", 4) != 0) {
+      throw std::runtime_error("npz_file: " + fname + " is corrupt");
     }
+    file_.read(record.data(), record.size(),
+               read_le<uint64_t>(locator.data() + 8));
+    if (std::memcmp(record.data(), "PK\x06\x06", 4) != 0) {
+      throw std::runtime_error("npz_file: " + fname + " is corrupt");
+    }
+    nrecs = read_le<uint64_t>(record.data() + 32);
+    global_header_size = read_le<uint64_t>(record.data() + 40);
+    global_header_offset = read_le<uint64_t>(record.data() + 48);
+  }
 
-    // erase the lagging .npy
-    varname.erase(varname.end() - 4, varname.end());
-
-    // read in the extra field
-    if (const uint16_t extra_field_len =
-            *reinterpret_cast<uint16_t *>(&local_header[28]);
-        extra_field_len > 0) {
-      std::vector<char> buff(extra_field_len);
-      if (const size_t efield_res =
-              fread(buff.data(), sizeof(char), extra_field_len, fp);
-          efield_res != extra_field_len) {
-        throw std::runtime_error("npz_load: failed fread");
+  if (global_header_offset > file_.size() ||
+      global_header_size > file_.size() - global_header_offset) {
+    throw std::runtime_error("npz_file: " + fname +
+                             " has a corrupt central directory");
+  }
+  std::vector<unsigned char> global_header(global_header_size);
+  file_.read(global_header.data(), global_header.size(), global_header_offset);
+
+  const unsigned char *p = global_header.data();
+  const unsigned char *const end = p + global_header.size();
+  for (uint64_t rec = 0; rec < nrecs; rec++) {
+    if (end - p < 46 || std::memcmp(p, "PK\x01\x02", 4) != 0) {
+      throw std::runtime_error("npz_file: " + fname +
+                               " has a corrupt central directory");
+    }
+
+    member m{};
+    m.compr_method = read_le<uint16_t>(p + 10);
+    m.compr_bytes = read_le<uint32_t>(p + 20);
+    m.uncompr_bytes = read_le<uint32_t>(p + 24);
+    const uint16_t name_len = read_le<uint16_t>(p + 28);
+    const uint16_t extra_field_len = read_le<uint16_t>(p + 30);
+    const uint16_t comment_len = read_le<uint16_t>(p + 32);
+    m.local_header_offset = read_le<uint32_t>(p + 42);
+
+    if (end - p < 46 + name_len + extra_field_len + comment_len) {
+      throw std::runtime_error("npz_file: " + fname +
+                               " has a corrupt central directory");
+    }
+    std::string varname(reinterpret_cast<const char *>(p + 46), name_len);
+
+    // the zip64 extra field holds the 64 bit value of every field set to
+    // 0xffffffff above, in this order
+    const unsigned char *extra = p + 46 + name_len;
+    const unsigned char *const extra_end = extra + extra_field_len;
+    while (extra_end - extra >= 4) {
+      const uint16_t id = read_le<uint16_t>(extra);
+      const uint16_t len = read_le<uint16_t>(extra + 2);
+      const unsigned char *value = extra + 4;
+      const unsigned char *const value_end =
+          std::min(value + len, extra_end);
+      if (id == 0x0001) {
+        for (uint64_t *field :
+             {&m.uncompr_bytes, &m.compr_bytes, &m.local_header_offset}) {
+          if (*field == 0xffffffff && value_end - value >= 8) {
+            *field = read_le<uint64_t>(value);
+            value += 8;
+          }
+        }
+      } else if (id == npz_filter_extra_id && value_end > value &&
+                 value_end - value - 1 >= value[0]) {
+        for (size_t f = 0; f < value[0]; f++) {
+          m.filters.push_back(static_cast<filter>(value[1 + f]));
+        }
       }
+      extra += 4 + len;
     }
 
-    const uint16_t compr_method =
-        *reinterpret_cast<uint16_t *>(local_header.data() + 8);
-    const uint32_t compr_bytes =
-        *reinterpret_cast<uint32_t *>(local_header.data() + 18);
-    const uint32_t uncompr_bytes =
-        *reinterpret_cast<uint32_t *>(local_header.data() + 22);
+    p += 46 + name_len + extra_field_len + comment_len;
 
-    if (compr_method == 0) {
-      arrays[varname] = load_the_npy_file(fp);
-    } else {
-      arrays[varname] = load_the_npz_array(fp, compr_bytes, uncompr_bytes);
+    // erase the lagging .npy
+    if (varname.ends_with(".npy")) {
+      varname.erase(varname.end() - 4, varname.end());
     }
+    members_[varname] = m;
   }
+}
+
+std::vector<std::string> cnpy::npz_file::names() const {
+  std::vector<std::string> names;
+  names.reserve(members_.size());
+  for (const auto &[name, m] : members_) {
+    names.push_back(name);
+  }
+  return names;
+}
+
+cnpy::npy_array cnpy::npz_file::load(const std::string &varname) const {
+  const auto it = members_.find(varname);
+  if (it == members_.end()) {
+    throw std::runtime_error("npz_load: Variable name " + varname +
+                             " not found in " + fname_);
+  }
+  return load(it->second);
+}
 
-  fclose(fp);
+cnpy::npz_t cnpy::npz_file::load_all() const {
+  npz_t arrays;
+  for (const auto &[name, m] : members_) {
+    arrays[name] = load(m);
+  }
   return arrays;
 }
 
+cnpy::npy_array cnpy::npz_file::load(const member &m) const {
+  npy_array array = read_member(m);
+  if (!m.filters.empty()) {
+    unfilter_npz_data(m.filters, array.data<char>(), array.num_bytes(),
+                      array.word_size());
+  }
+  return array;
+}
+
+cnpy::npy_array cnpy::npz_file::read_member(const member &m) const {
+  // the local header can have a different extra field than the central
+  // directory, so its size is only known after reading it
+  std::array<unsigned char, 30> local_header{};
+  file_.read(local_header.data(), local_header.size(), m.local_header_offset);
+  if (std::memcmp(local_header.data(), "PK\x03\x04", 4) != 0) {
+    throw std::runtime_error("npz_load: corrupt local header in " + fname_);
+  }
+  const uint64_t data_offset = m.local_header_offset + local_header.size() +
+                               read_le<uint16_t>(local_header.data() + 26) +
+                               read_le<uint16_t>(local_header.data() + 28);
+  if (data_offset > file_.size() ||
+      m.compr_bytes > file_.size() - data_offset) {
+    throw std::runtime_error("npz_load: " + fname_ + " is truncated");
+  }
+
+  if (m.compr_method == 0) {
+    const npy_header_info header =
+        read_npy_header(file_, data_offset, m.compr_bytes);
+    npy_array array(header.shape, header.word_size, header.fortran_order);
+    file_.read(array.data<char>(), array.num_bytes(),
+               data_offset + header.header_size);
+    return array;
+  }
+
+  // the uncompressed size is only trusted up to the largest compression ratio
+  // of the method, 1032:1 for deflate and 32768:1 for zstd (a 128 KiB block in
+  // 4 bytes), so corrupt sizes fail before allocating the buffer
+  const uint64_t max_ratio =
+      m.compr_method == Z_DEFLATED ? 1032 : uint64_t{1} << 15;
+  if (m.uncompr_bytes / max_ratio > m.compr_bytes) {
+    throw std::runtime_error("npz_load: corrupt uncompressed size in " +
+                             fname_);
+  }
+
+  if (m.compr_method == Z_DEFLATED) {
+    std::vector<unsigned char> buffer_compr(m.compr_bytes);
+    file_.read(buffer_compr.data(), buffer_compr.size(), data_offset);
+    return inflate_npy(buffer_compr, m.uncompr_bytes);
+  }
+
+#ifdef CNPY_WITH_ZSTD
+  if (m.compr_method == static_cast<uint16_t>(compression::zstd)) {
+    std::vector<unsigned char> buffer_compr(m.compr_bytes);
+    file_.read(buffer_compr.data(), buffer_compr.size(), data_offset);
+    return zstd_decompress_npy(buffer_compr, m.uncompr_bytes);
+  }
+#endif
+
+  throw std::runtime_error("npz_load: unsupported compression method " +
+                           std::to_string(m.compr_method) + " in " + fname_);
+}
+
+bool cnpy::compression_supported(const compression method) noexcept {
+  switch (method) {
+  case compression::none:
+  case compression::deflate:
+    return true;
+  case compression::zstd:
+#ifdef CNPY_WITH_ZSTD
+    return true;
+#else
+    return false;
+#endif
+  }
+  return false;
+}
+
+std::vector<char> cnpy::compress_npz_member(const compression method,
+                                            const char *header,
+                                            const size_t header_size,
+                                            const void *data,
+                                            const size_t nbytes) {
+  switch (method) {
+  case compression::deflate:
+    return deflate_member(header, header_size, data, nbytes);
+#ifdef CNPY_WITH_ZSTD
+  case compression::zstd:
+    return zstd_member(header, header_size, data, nbytes);
+#endif
+  default:
+    throw std::runtime_error(
+        "npz_save: compression method " +
+        std::to_string(static_cast<uint16_t>(method)) +
+        " is not supported by this build");
+  }
+}
+
+std::vector<char> cnpy::filter_npz_data(const std::vector<filter> &filters,
+                                        const void *data, const size_t nbytes,
+                                        const size_t word_size) {
+  const auto *in = static_cast<const char *>(data);
+  std::vector<char> filtered(in, in + nbytes);
+  std::vector<char> scratch(nbytes);
+  for (const filter f : filters) {
+    apply_filter(f, filtered.data(), scratch.data(), nbytes, word_size, true);
+    filtered.swap(scratch);
+  }
+  return filtered;
+}
+
+void cnpy::unfilter_npz_data(const std::vector<filter> &filters, char *data,
+                             const size_t nbytes, const size_t word_size) {
+  if (word_size == 0 || nbytes == 0) {
+    return;
+  }
+
+  std::vector<char> scratch(nbytes);
+  for (auto f = filters.rbegin(); f != filters.rend(); ++f) {
+    apply_filter(*f, data, scratch.data(), nbytes, word_size, false);
+    std::memcpy(data, scratch.data(), nbytes);
+  }
+}
+
+cnpy::npz_t cnpy::npz_load(const std::string &fname) {
+  return npz_file(fname).load_all();
+}
+
 cnpy::npy_array cnpy::npz_load(const std::string &fname,
                                const std::string &varname) {
-  FILE *fp = fopen(fname.c_str(), "rb");
+  return npz_file(fname).load(varname);
+}
+
+cnpy::npy_array cnpy::npy_load(const std::string &fname) {
+  return npy_file(fname).load();
+}
+
+std::vector<cnpy::batch_load_result>
+cnpy::npy_load_batch(const std::vector<std::string> &fnames,
+                     size_t num_threads) {
+  if (num_threads == 0) {
+    num_threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+
+  std::vector<batch_load_result> results(fnames.size());
+  std::vector<std::vector<char>> io_buffers(num_threads);
+
+  run_batch(fnames.size(), num_threads,
+            [&](const size_t worker, const size_t i) {
+              batch_load_result &result = results[i];
+
+              try {
+                file_ptr fp(fopen(fnames[i].c_str(), "rb"));
+                if (!fp) {
+                  result.status.error =
+                      "npy_load_batch: Unable to open file " + fnames[i];
+                  return;
+                }
+
+                std::vector<char> &io_buffer = io_buffers[worker];
+                io_buffer.resize(batch_io_buffer_size);
+                setvbuf(fp.get(), io_buffer.data(), _IOFBF, io_buffer.size());
+
+                result.array = load_the_npy_file(fp.get());
+                result.status.ok = true;
+              } catch (const std::exception &e) {
+                result.status.error = e.what();
+              }
+            });
+
+  return results;
+}
 
-  if (!fp) {
-    throw std::runtime_error("npz_load: Unable to open file " + fname);
+void cnpy::write_shard_index(const std::string &index_fname,
+                             const std::string &descr,
+                             const std::vector<size_t> &row_shape,
+                             const std::vector<shard_info> &shards) {
+  std::ofstream index(index_fname);
+  if (!index) {
+    throw std::runtime_error("write_shard_index: Unable to open file " +
+                             index_fname);
+  }
+
+  index << "cnpy_shards 1\n";
+  index << "descr " << descr << "\n";
+  index << "row_shape " << row_shape.size();
+  for (const size_t dim : row_shape) {
+    index << ' ' << dim;
+  }
+  index << "\nshards " << shards.size() << "\n";
+  for (const shard_info &shard : shards) {
+    index << std::quoted(std::filesystem::path(shard.fname).filename().string())
+          << ' ' << shard.begin << ' ' << shard.end << "\n";
+  }
+
+  if (!index.flush()) {
+    throw std::runtime_error("write_shard_index: failed write to " +
+                             index_fname);
+  }
+}
+
+cnpy::sharded_reader::sharded_reader(const std::string &index_fname) {
+  std::ifstream index(index_fname);
+  if (!index) {
+    throw std::runtime_error("sharded_reader: Unable to open file " +
+                             index_fname);
+  }
+
+  std::string keyword;
+  int version = 0;
+  size_t rank = 0;
+  size_t num_shards = 0;
+  index >> keyword >> version;
+  if (!index || keyword != "cnpy_shards" || version != 1) {
+    throw std::runtime_error("sharded_reader: " + index_fname +
+                             " is not a shard index");
+  }
+  index >> keyword >> descr_ >> keyword >> rank;
+  // numpy arrays have at most 64 dimensions
+  if (!index || rank > 64) {
+    throw std::runtime_error("sharded_reader: malformed index " +
+                             index_fname);
+  }
+  row_shape_.resize(rank);
+  for (size_t &dim : row_shape_) {
+    index >> dim;
   }
+  index >> keyword >> num_shards;
 
-  while (true) {
-    std::vector<char> local_header(30);
-    if (const size_t header_res =
-            fread(local_header.data(), sizeof(char), 30, fp);
-        header_res != 30) {
-      throw std::runtime_error("npz_load: failed fread");
+  // e.g. "<f8", the word size follows byte order and type
+  const std::string_view str_ws = descr_.size() < 3
+                                      ? std::string_view()
+                                      : std::string_view(descr_).substr(2);
+  const auto [ptr, ec] = std::from_chars(
+      str_ws.data(), str_ws.data() + str_ws.size(), word_size_);
+  if (!index || ec != std::errc() || ptr != str_ws.data() + str_ws.size() ||
+      word_size_ == 0) {
+    throw std::runtime_error("sharded_reader: malformed index " +
+                             index_fname);
+  }
+
+  const std::filesystem::path dir =
+      std::filesystem::path(index_fname).parent_path();
+  for (size_t i = 0; i < num_shards; i++) {
+    shard_info shard{};
+    std::string fname;
+    index >> std::quoted(fname) >> shard.begin >> shard.end;
+    if (!index || shard.begin != num_rows_ || shard.end < shard.begin) {
+      throw std::runtime_error("sharded_reader: malformed index " +
+                               index_fname);
     }
+    shard.fname = (dir / fname).string();
+    num_rows_ = shard.end;
+    shards_.push_back(std::move(shard));
+  }
+}
 
-    // if we've reached the global header, stop reading
-    if (local_header[2] != 0x03 || local_header[3] != 0x04) {
-      break;
+cnpy::npy_array
+cnpy::sharded_reader::read_rows(const size_t begin, const size_t end,
+                                const size_t num_threads) const {
+  if (begin > end || end > num_rows_) {
+    throw std::runtime_error("sharded_reader: rows [" + std::to_string(begin) +
+                             ", " + std::to_string(end) + ") out of range");
+  }
+
+  std::vector<size_t> shape{end - begin};
+  shape.insert(shape.end(), row_shape_.begin(), row_shape_.end());
+  npy_array array(shape, word_size_, false);
+  const size_t row_bytes =
+      std::accumulate(row_shape_.begin(), row_shape_.end(), word_size_,
+                      std::multiplies<size_t>());
+
+  // the shards overlapping [begin, end)
+  const auto first =
+      std::upper_bound(shards_.begin(), shards_.end(), begin,
+                       [](const size_t row, const shard_info &shard) {
+                         return row < shard.end;
+                       });
+  const auto last = std::lower_bound(
+      first, shards_.end(), end, [](const shard_info &shard, const size_t row) {
+        return shard.begin < row;
+      });
+  const std::vector<shard_info> parts(first, last);
+  std::vector<std::string> errors(parts.size());
+
+  run_batch(parts.size(), num_threads, [&](size_t, const size_t i) {
+    const shard_info &shard = parts[i];
+    const size_t lo = std::max(begin, shard.begin);
+    const size_t hi = std::min(end, shard.end);
+
+    try {
+      const npy_file file(shard.fname);
+      const std::vector<size_t> &shard_shape = file.shape();
+      // '|' (byte order not applicable) matches any byte order
+      const std::string &shard_descr = file.descr();
+      const bool same_dtype =
+          shard_descr.substr(1) == descr_.substr(1) &&
+          (shard_descr[0] == descr_[0] || shard_descr[0] == '|' ||
+           descr_[0] == '|');
+      if (!same_dtype || file.fortran_order() ||
+          file.word_size() != word_size_ || shard_shape.empty() ||
+          shard_shape[0] < shard.end - shard.begin ||
+          !std::equal(row_shape_.begin(), row_shape_.end(),
+                      shard_shape.begin() + 1, shard_shape.end())) {
+        throw std::runtime_error("sharded_reader: " + shard.fname +
+                                 " does not match the index");
+      }
+
+      file.read(array.data<char>() + (lo - begin) * row_bytes,
+                (hi - lo) * row_bytes, (lo - shard.begin) * row_bytes);
+    } catch (const std::exception &e) {
+      errors[i] = e.what();
     }
+  });
 
-    // read in the variable name
-    const uint16_t name_len = *reinterpret_cast<uint16_t *>(&local_header[26]);
-    std::string vname(name_len, ' ');
-    if (const size_t vname_res =
-            fread(vname.data(), sizeof(char), name_len, fp);
-        vname_res != name_len) {
-      throw std::runtime_error("npz_load: failed fread");
-    }
-    vname.erase(vname.end() - 4, vname.end()); // erase the lagging .npy
-
-    // read in the extra field
-    const uint16_t extra_field_len =
-        *reinterpret_cast<uint16_t *>(&local_header[28]);
-    fseek(fp, extra_field_len, SEEK_CUR); // skip past the extra field
-
-    const uint16_t compr_method =
-        *reinterpret_cast<uint16_t *>(local_header.data() + 8);
-    const uint32_t compr_bytes =
-        *reinterpret_cast<uint32_t *>(local_header.data() + 18);
-    const uint32_t uncompr_bytes =
-        *reinterpret_cast<uint32_t *>(local_header.data() + 22);
-
-    if (vname == varname) {
-      npy_array array = compr_method == 0 ? load_the_npy_file(fp)
-                                          : load_the_npz_array(fp, compr_bytes,
-                                                               uncompr_bytes);
-      fclose(fp);
-      return array;
-    } else {
-      // skip past the data
-      const uint32_t size = *reinterpret_cast<uint32_t *>(&local_header[22]);
-      fseek(fp, size, SEEK_CUR);
+  for (const std::string &error : errors) {
+    if (!error.empty()) {
+      throw std::runtime_error(error);
     }
   }
+  return array;
+}
 
-  fclose(fp);
+cnpy::npy_array cnpy::array_cache::npy_load(const std::string &fname) {
+  return load(fname, "");
+}
 
-  // if we get here, we haven't found the variable in the file
-  throw std::runtime_error("npz_load: Variable name " + varname +
-                           " not found in " + fname);
+cnpy::npy_array cnpy::array_cache::npz_load(const std::string &fname,
+                                            const std::string &varname) {
+  return load(fname, varname);
 }
 
-cnpy::npy_array cnpy::npy_load(const std::string &fname) {
+cnpy::npy_array cnpy::array_cache::load(const std::string &fname,
+                                        const std::string &varname) {
+  // errors are ignored here, a missing file is reported by the load below
+  std::error_code ec;
+  const auto mtime = std::filesystem::last_write_time(fname, ec);
+  const uintmax_t file_size = ec ? 0 : std::filesystem::file_size(fname, ec);
+
+  const std::string key = fname + '\0' + varname;
+  std::promise<npy_array> promise;
+  std::shared_ptr<entry> loading;
+  std::shared_future<npy_array> cached;
 
-  FILE *fp = fopen(fname.c_str(), "rb");
+  {
+    std::lock_guard lock(mutex_);
+    if (const auto it = entries_.find(key); it != entries_.end()) {
+      if (it->second->mtime == mtime && it->second->file_size == file_size) {
+        hits_++;
+        if (it->second->ready) {
+          lru_.splice(lru_.begin(), lru_, it->second->lru);
+        }
+        cached = it->second->array;
+      } else {
+        drop(it);
+      }
+    }
 
-  if (!fp) {
-    throw std::runtime_error("npy_load: Unable to open file " + fname);
+    if (!cached.valid()) {
+      misses_++;
+      loading = std::make_shared<entry>();
+      loading->array = promise.get_future().share();
+      loading->mtime = mtime;
+      loading->file_size = file_size;
+      entries_[key] = loading;
+    }
   }
 
-  npy_array arr = load_the_npy_file(fp);
+  if (cached.valid()) {
+    return cached.get();
+  }
 
-  fclose(fp);
-  return arr;
+  npy_array array;
+  try {
+    array = varname.empty() ? cnpy::npy_load(fname)
+                            : cnpy::npz_load(fname, varname);
+  } catch (...) {
+    {
+      std::lock_guard lock(mutex_);
+      if (const auto it = entries_.find(key);
+          it != entries_.end() && it->second == loading) {
+        entries_.erase(it);
+      }
+    }
+    promise.set_exception(std::current_exception());
+    throw;
+  }
+
+  {
+    std::lock_guard lock(mutex_);
+    // the entry is gone if the cache was cleared or the file changed while
+    // loading, the array is still handed out but not cached
+    if (const auto it = entries_.find(key);
+        it != entries_.end() && it->second == loading) {
+      loading->ready = true;
+      loading->num_bytes = array.num_bytes();
+      loading->lru = lru_.insert(lru_.begin(), key);
+      num_bytes_ += loading->num_bytes;
+      evict();
+    }
+  }
+
+  promise.set_value(array);
+  return array;
+}
+
+void cnpy::array_cache::drop(const entry_map::iterator it) {
+  if (it->second->ready) {
+    num_bytes_ -= it->second->num_bytes;
+    lru_.erase(it->second->lru);
+  }
+  entries_.erase(it);
+}
+
+void cnpy::array_cache::evict() {
+  while (num_bytes_ > max_bytes_ && !lru_.empty()) {
+    drop(entries_.find(lru_.back()));
+    evictions_++;
+  }
+}
+
+void cnpy::array_cache::set_max_bytes(const size_t max_bytes) {
+  std::lock_guard lock(mutex_);
+  max_bytes_ = max_bytes;
+  evict();
+}
+
+void cnpy::array_cache::clear() {
+  std::lock_guard lock(mutex_);
+  entries_.clear();
+  lru_.clear();
+  num_bytes_ = 0;
+}
+
+cnpy::cache_stats cnpy::array_cache::stats() const {
+  std::lock_guard lock(mutex_);
+  return {hits_, misses_, evictions_, lru_.size(), num_bytes_};
+}
+
+cnpy::array_cache &cnpy::global_array_cache() {
+  static array_cache cache(256 << 20);
+  return cache;
+}
+
+cnpy::npy_batch_reader::npy_batch_reader(const std::string &fname,
+                                         const size_t batch_rows,
+                                         const size_t num_buffers)
+    : file_(fname), batch_rows_(std::max<size_t>(1, batch_rows)),
+      buffers_(std::max<size_t>(2, num_buffers)) {
+  if (file_.fortran_order()) {
+    throw std::runtime_error("npy_batch_reader: " + fname +
+                             " is in fortran order, rows are not contiguous");
+  }
+
+  const std::vector<size_t> &shape = file_.shape();
+  num_rows_ = shape.empty() ? 1 : shape[0];
+  row_bytes_ = shape.empty() ? file_.word_size()
+                             : std::accumulate(shape.begin() + 1, shape.end(),
+                                               file_.word_size(),
+                                               std::multiplies<size_t>());
+  num_batches_ = (num_rows_ + batch_rows_ - 1) / batch_rows_;
+
+  for (buffer &b : buffers_) {
+    b.data.resize(std::min(batch_rows_, num_rows_) * row_bytes_);
+    b.batch = std::numeric_limits<size_t>::max();
+  }
+
+  file_.advise_sequential();
+  thread_ = std::thread(&npy_batch_reader::read_ahead, this);
+}
+
+cnpy::npy_batch_reader::~npy_batch_reader() {
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+void cnpy::npy_batch_reader::read_ahead() {
+  for (size_t batch = 0; batch < num_batches_; batch++) {
+    {
+      // the buffer of this batch is free once the batch num_buffers before
+      // it was released
+      std::unique_lock lock(mutex_);
+      cv_.wait(lock,
+               [&] { return stop_ || batch < released_ + buffers_.size(); });
+      if (stop_) {
+        return;
+      }
+    }
+
+    buffer &b = buffers_[batch % buffers_.size()];
+    const size_t first_row = batch * batch_rows_;
+    b.num_rows = std::min(batch_rows_, num_rows_ - first_row);
+    try {
+      file_.read(b.data.data(), b.num_rows * row_bytes_,
+                 first_row * row_bytes_);
+    } catch (...) {
+      b.error = std::current_exception();
+    }
+
+    {
+      std::lock_guard lock(mutex_);
+      b.batch = batch;
+    }
+    cv_.notify_all();
+
+    if (b.error) {
+      return;
+    }
+  }
+}
+
+std::optional<cnpy::npy_batch> cnpy::npy_batch_reader::next() {
+  std::unique_lock lock(mutex_);
+  // the batch handed out last time is done
+  released_ = next_batch_;
+  cv_.notify_all();
+
+  if (next_batch_ == num_batches_) {
+    return std::nullopt;
+  }
+
+  buffer &b = buffers_[next_batch_ % buffers_.size()];
+  cv_.wait(lock, [&] { return b.batch == next_batch_; });
+  if (b.error) {
+    std::rethrow_exception(b.error);
+  }
+
+  const npy_batch batch{next_batch_ * batch_rows_, b.num_rows, b.data.data(),
+                        b.num_rows * row_bytes_};
+  next_batch_++;
+  return batch;
 }
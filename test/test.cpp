@@ -1,9 +1,13 @@
 #include "../include/cnpy/cnpy.hpp"
+#include <array>
 #include <complex>
+#include <cstring>
+#include <fstream>
 #include <gtest/gtest.h>
 #include <map>
 #include <random>
 #include <string>
+#include <thread>
 
 constexpr int nx = 128;
 constexpr int ny = 64;
@@ -25,6 +29,17 @@ auto get_data() {
   return data;
 }
 
+void write_file(const std::string &fname, const std::string_view contents) {
+  std::ofstream(fname, std::ios::binary)
+      .write(contents.data(), static_cast<std::streamsize>(contents.size()));
+}
+
+std::string read_file(const std::string &fname) {
+  std::ifstream file(fname, std::ios::binary);
+  return {std::istreambuf_iterator<char>(file),
+          std::istreambuf_iterator<char>()};
+}
+
 TEST(NpyLoad, Npy) {
 
   const cnpy::npy_array arr = cnpy::npy_load(npy_file);
@@ -79,6 +94,288 @@ TEST(NpyAppend, Npy) {
   for (int i = 0; i < nx * ny * (nz + nz); i++) {
     ASSERT_EQ(expected[i], loaded_data[i]);
   }
+
+  // mismatching appends throw before the file is touched
+  const std::vector<double> values(6);
+  cnpy::npy_save("arr1.npy", values.data(), {6});
+  EXPECT_THROW(cnpy::npy_save("arr1.npy", values.data(), {2, 3}, "a"),
+               std::runtime_error);
+  EXPECT_THROW(cnpy::npy_save("arr1.npy", std::vector<float>(6), "a"),
+               std::runtime_error);
+  cnpy::npy_save("arr1.npy", values.data(), {2, 3});
+  EXPECT_THROW(cnpy::npy_save("arr1.npy", values.data(), {3, 2}, "a"),
+               std::runtime_error);
+  EXPECT_EQ(cnpy::npy_load("arr1.npy").shape(), (std::vector<size_t>{2, 3}));
+}
+
+TEST(NpyHeader, Npy) {
+  const std::array<size_t, 3> shape{nz, ny, nx};
+  const cnpy::npy_header<std::complex<double>, 3> header(shape);
+  const auto expected =
+      cnpy::create_npy_header<std::complex<double>>({nz, ny, nx});
+
+  ASSERT_EQ(header.size() % 16, 0);
+  ASSERT_EQ(std::string_view(header.data(), header.size()),
+            std::string_view(expected.data(), expected.size()));
+  EXPECT_NE(std::string_view(header.data(), header.size())
+                .find("{'descr': '<c16', 'fortran_order': False, 'shape': "
+                      "(32, 64, 128), }"),
+            std::string_view::npos);
+}
+
+TEST(NpySaveFixedRank, Npy) {
+
+  const auto data = get_data();
+
+  cnpy::npy_save("arr2.npy", data.data(), std::array<size_t, 3>{nz, ny, nx});
+
+  cnpy::npy_array arr = cnpy::npy_load("arr2.npy");
+  const auto *loaded_data = arr.data<std::complex<double>>();
+
+  const auto shape = arr.shape();
+
+  ASSERT_EQ(arr.word_size(), sizeof(std::complex<double>));
+  ASSERT_TRUE(shape.size() == 3 && shape[0] == nz && shape[1] == ny &&
+              shape[2] == nx);
+  for (int i = 0; i < nx * ny * nz; i++) {
+    ASSERT_EQ(data[i], loaded_data[i]);
+  }
+}
+
+TEST(NpyFortranOrder, Npy) {
+  // a 4x3 column-major matrix, appended with two more columns
+  const std::vector<double> first{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+  const std::vector<double> second{12, 13, 14, 15, 16, 17, 18, 19};
+
+  cnpy::npy_save("fortran.npy", first.data(), {4, 3}, "w", true);
+  cnpy::npy_save("fortran.npy", second.data(), {4, 2}, "a", true);
+  EXPECT_THROW(cnpy::npy_save("fortran.npy", second.data(), {2, 4}, "a"),
+               std::runtime_error);
+
+  const cnpy::npy_array arr = cnpy::npy_load("fortran.npy");
+  ASSERT_TRUE(arr.fortran_order());
+  ASSERT_EQ(arr.shape(), (std::vector<size_t>{4, 5}));
+  const auto values = arr.as_vec<double>();
+  for (size_t i = 0; i < values.size(); i++) {
+    ASSERT_EQ(values[i], static_cast<double>(i));
+  }
+
+  // columns 1 and 2, without copying
+  const cnpy::npy_array columns = arr.slice(1, 3);
+  ASSERT_EQ(columns.shape(), (std::vector<size_t>{4, 2}));
+  ASSERT_EQ(columns.num_bytes(), 8 * sizeof(double));
+  ASSERT_EQ(columns.data<double>(), arr.data<double>() + 4);
+  EXPECT_THROW((void)arr.slice(2, 6), std::out_of_range);
+
+  cnpy::npz_save("fortran.npz", "a", first.data(), {4, 3}, "w", true);
+  const cnpy::npy_array member = cnpy::npz_load("fortran.npz", "a");
+  ASSERT_TRUE(member.fortran_order());
+  ASSERT_EQ(member.as_vec<double>(), first);
+}
+
+TEST(NpyScalarAndEmpty, Npy) {
+  const double scalar = 42.5;
+  cnpy::npy_save("scalar.npy", &scalar, std::vector<size_t>{});
+  EXPECT_THROW(cnpy::npy_save("scalar.npy", &scalar, {1}, "a"),
+               std::runtime_error);
+
+  const cnpy::npy_array arr = cnpy::npy_load("scalar.npy");
+  ASSERT_TRUE(arr.shape().empty());
+  ASSERT_EQ(arr.num_vals(), 1);
+  ASSERT_EQ(*arr.data<double>(), scalar);
+
+  cnpy::npy_save("empty.npy", static_cast<const float *>(nullptr), {0, 3});
+  const cnpy::npy_array empty = cnpy::npy_load("empty.npy");
+  ASSERT_EQ(empty.shape(), (std::vector<size_t>{0, 3}));
+  ASSERT_EQ(empty.num_vals(), 0);
+  ASSERT_EQ(empty.num_bytes(), 0);
+
+  cnpy::npz_save("scalar.npz", "s", &scalar, {}, "w", false,
+                 cnpy::compression::deflate);
+  cnpy::npz_save("scalar.npz", "e", static_cast<const float *>(nullptr), {0},
+                 "a", false, cnpy::compression::deflate);
+
+  // the data of an empty vector is null
+  cnpy::npy_save("empty.npy", std::vector<float>{});
+  ASSERT_EQ(cnpy::npy_load("empty.npy").shape(), (std::vector<size_t>{0}));
+  cnpy::npz_save("scalar.npz", "v", std::vector<float>{}, "a",
+                 cnpy::compression::none, {cnpy::filter::shuffle});
+  ASSERT_EQ(cnpy::npz_load("scalar.npz", "v").num_vals(), 0);
+  const cnpy::npz_t members = cnpy::npz_load("scalar.npz");
+  ASSERT_TRUE(members.at("s").shape().empty());
+  ASSERT_EQ(*members.at("s").data<double>(), scalar);
+  ASSERT_EQ(members.at("e").shape(), (std::vector<size_t>{0}));
+  ASSERT_EQ(members.at("e").num_bytes(), 0);
+}
+
+TEST(NpyAppendGrowsHeader, Npy) {
+  // the header of a (9, 10, 10, 100) int8 array just fits into 80 bytes, with
+  // 10 rows it needs 96, so the data has to move when appending the 10th row
+  std::vector<char> row(10 * 10 * 100);
+  cnpy::npy_save("grow.npy", row.data(), {1, 10, 10, 100});
+  for (char i = 1; i < 12; i++) {
+    std::fill(row.begin(), row.end(), i);
+    cnpy::npy_save("grow.npy", row.data(), {1, 10, 10, 100}, "a");
+  }
+
+  const cnpy::npy_file file("grow.npy");
+  ASSERT_EQ(file.data_offset(), 96);
+  const cnpy::npy_array arr = file.load();
+  ASSERT_EQ(arr.shape(), (std::vector<size_t>{12, 10, 10, 100}));
+  for (size_t i = 0; i < arr.num_vals(); i++) {
+    ASSERT_EQ(arr.data<char>()[i], static_cast<char>(i / row.size()));
+  }
+}
+
+TEST(NpyBatch, Npy) {
+
+  const auto data = get_data();
+
+  std::vector<cnpy::npy_save_item<std::complex<double>>> items;
+  std::vector<std::string> fnames;
+  for (size_t i = 0; i < 16; i++) {
+    fnames.push_back("batch" + std::to_string(i) + ".npy");
+    items.push_back({fnames.back(), data.data() + i * nx, {ny, 2}});
+  }
+  items.push_back({"missing_dir/batch.npy", data.data(), {1}});
+  fnames.push_back("missing_dir/batch.npy");
+
+  const auto saved = cnpy::npy_save_batch(items, 4);
+  ASSERT_EQ(saved.size(), items.size());
+  for (size_t i = 0; i < 16; i++) {
+    ASSERT_TRUE(saved[i].ok) << saved[i].error;
+  }
+  EXPECT_FALSE(saved.back().ok);
+  EXPECT_FALSE(saved.back().error.empty());
+
+  const auto loaded = cnpy::npy_load_batch(fnames, 4);
+  ASSERT_EQ(loaded.size(), fnames.size());
+  for (size_t i = 0; i < 16; i++) {
+    ASSERT_TRUE(loaded[i].status.ok) << loaded[i].status.error;
+    const auto shape = loaded[i].array.shape();
+    ASSERT_TRUE(shape.size() == 2 && shape[0] == ny && shape[1] == 2);
+    const auto *loaded_data = loaded[i].array.data<std::complex<double>>();
+    for (size_t j = 0; j < ny * 2; j++) {
+      ASSERT_EQ(data[i * nx + j], loaded_data[j]);
+    }
+  }
+  EXPECT_FALSE(loaded.back().status.ok);
+}
+
+TEST(ShardedArray, Npy) {
+
+  const auto data = get_data();
+  constexpr size_t row_bytes = nx * sizeof(std::complex<double>);
+
+  {
+    // 5 rows per shard, appended in chunks that do not line up with shards
+    cnpy::sharded_writer<std::complex<double>> writer("sharded", {nx},
+                                                      5 * row_bytes + 1);
+    writer.append(data.data(), 3);
+    writer.append(data.data() + 3 * nx, 9);
+    writer.append(data.data() + 12 * nx, 11);
+    ASSERT_EQ(writer.num_rows(), 23);
+    ASSERT_EQ(writer.shards().size(), 5);
+  }
+
+  const cnpy::sharded_reader reader("sharded.idx");
+  ASSERT_EQ(reader.num_rows(), 23);
+  ASSERT_EQ(reader.shape(), std::vector<size_t>({23, nx}));
+  ASSERT_EQ(reader.descr(), "<c16");
+
+  const cnpy::npy_array rows = reader.read_rows(4, 17, 3);
+  ASSERT_EQ(rows.shape(), std::vector<size_t>({13, nx}));
+  const auto *loaded_data = rows.data<std::complex<double>>();
+  for (size_t i = 0; i < 13 * nx; i++) {
+    ASSERT_EQ(data[4 * nx + i], loaded_data[i]);
+  }
+
+  EXPECT_EQ(reader.read_rows(7, 7).num_vals(), 0);
+  EXPECT_THROW(reader.read_rows(20, 24), std::runtime_error);
+
+  // shards with the right word size but another dtype or memory order
+  const std::vector<long double> other(5 * nx);
+  cnpy::npy_save("sharded_00001.npy", other.data(), {5, nx});
+  EXPECT_THROW(reader.read_rows(4, 17), std::runtime_error);
+  cnpy::npy_save("sharded_00001.npy", data.data() + 5 * nx, {5, nx}, "w",
+                 true);
+  EXPECT_THROW(reader.read_rows(4, 17), std::runtime_error);
+  EXPECT_NO_THROW(reader.read_rows(0, 5));
+
+  std::string index = read_file("sharded.idx");
+  index.replace(index.find("<c16"), 4, "<cXY");
+  write_file("malformed.idx", index);
+  EXPECT_THROW(cnpy::sharded_reader("malformed.idx"), std::runtime_error);
+}
+
+TEST(ArrayCache, Npz) {
+
+  cnpy::array_cache cache(1 << 20);
+
+  std::vector<std::thread> threads;
+  std::vector<cnpy::npy_array> arrays(8);
+  for (size_t i = 0; i < arrays.size(); i++) {
+    threads.emplace_back(
+        [&, i] { arrays[i] = cache.npz_load(npz_file, "f"); });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  // every thread got the same buffer from a single load
+  for (const cnpy::npy_array &array : arrays) {
+    ASSERT_EQ(array.data<double>(), arrays[0].data<double>());
+  }
+  EXPECT_EQ(arrays[0].as_vec<double>(), std::vector<double>({.1, .2, .3}));
+
+  auto stats = cache.stats();
+  EXPECT_EQ(stats.misses, 1);
+  EXPECT_EQ(stats.hits, arrays.size() - 1);
+  EXPECT_EQ(stats.num_arrays, 1);
+
+  cache.npy_load(npy_file);
+  cache.npz_load(npz_file, "f");
+  stats = cache.stats();
+  EXPECT_EQ(stats.misses, 2);
+  EXPECT_EQ(stats.num_arrays, 2);
+
+  // only the most recently used array fits
+  cache.set_max_bytes(arrays[0].num_bytes());
+  stats = cache.stats();
+  EXPECT_EQ(stats.evictions, 1);
+  EXPECT_EQ(stats.num_arrays, 1);
+  cache.npz_load(npz_file, "f");
+  EXPECT_EQ(cache.stats().hits, stats.hits + 1);
+
+  EXPECT_THROW(cache.npy_load("missing.npy"), std::runtime_error);
+  EXPECT_EQ(cache.stats().num_arrays, 1);
+}
+
+TEST(NpyBatchReader, Npy) {
+
+  const auto data = get_data();
+  cnpy::npy_save("arr3.npy", data.data(), {nz * ny, nx});
+
+  // 2048 rows in batches of 300, the last one is partial
+  cnpy::npy_batch_reader reader("arr3.npy", 300);
+  ASSERT_EQ(reader.num_batches(), 7);
+
+  size_t rows = 0;
+  while (const auto batch = reader.next()) {
+    ASSERT_EQ(batch->first_row, rows);
+    ASSERT_EQ(batch->num_rows, std::min<size_t>(300, nz * ny - rows));
+    const auto *loaded_data = batch->data<std::complex<double>>();
+    for (size_t i = 0; i < batch->num_rows * nx; i++) {
+      ASSERT_EQ(data[rows * nx + i], loaded_data[i]);
+    }
+    rows += batch->num_rows;
+  }
+  EXPECT_EQ(rows, nz * ny);
+  EXPECT_FALSE(reader.next());
+
+  // stopping early joins the read-ahead thread
+  cnpy::npy_batch_reader partial("arr3.npy", 16, 2);
+  ASSERT_TRUE(partial.next());
 }
 
 TEST(NpzLoadAll, Npz) {
@@ -116,7 +413,6 @@ TEST(NpzLoadSingleFirst, Npz) {
   EXPECT_EQ(f[2], .3);
 }
 
-// TODO: It looks like it's only possible to load the first one by name(?)
 TEST(NpzLoadSingleSecond, Npz) {
   const auto s = cnpy::npz_load(npz_file, "s").as_vec<long long>();
   EXPECT_EQ(s.size(), 3);
@@ -125,13 +421,35 @@ TEST(NpzLoadSingleSecond, Npz) {
   EXPECT_EQ(s[2], 3);
 }
 
-// TODO: It looks like it's only possible to load the first one by name(?)
 TEST(NpzLoadSingleThird, Npz) {
   const auto t = cnpy::npz_load(npz_file, "t").as_vec<char>();
   EXPECT_EQ(t.size(), 1);
   EXPECT_EQ(t[0], 'a');
 }
 
+TEST(NpzFileConcurrent, Npz) {
+
+  const cnpy::npz_file npz(npz_file);
+  ASSERT_EQ(npz.names(), std::vector<std::string>({"f", "s", "t"}));
+  ASSERT_TRUE(npz.contains("s"));
+  ASSERT_FALSE(npz.contains("u"));
+
+  std::vector<std::thread> threads;
+  std::vector<std::vector<long long>> loaded(16);
+  for (size_t i = 0; i < loaded.size(); i++) {
+    threads.emplace_back(
+        [&, i] { loaded[i] = npz.load("s").as_vec<long long>(); });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  for (const auto &s : loaded) {
+    EXPECT_EQ(s, std::vector<long long>({1, 2, 3}));
+  }
+  EXPECT_THROW(npz.load("u"), std::runtime_error);
+}
+
 TEST(NpzSave, Npz) {
 
   const auto data = get_data();
@@ -159,6 +477,249 @@ TEST(NpzSave, Npz) {
   ASSERT_EQ(mv1[0], my_var1);
 }
 
+TEST(NpzSaveCompressed, Npz) {
+
+  const auto data = get_data();
+
+  for (const auto method :
+       {cnpy::compression::deflate, cnpy::compression::zstd}) {
+    if (!cnpy::compression_supported(method)) {
+      // rejected before the file written by the previous method is truncated
+      EXPECT_THROW(cnpy::npz_save("compressed.npz", "arr1", data.data(),
+                                  {nz, ny, nx}, "w", false, method),
+                   std::runtime_error);
+      EXPECT_EQ(cnpy::npz_load("compressed.npz", "my_var1").num_vals(), 1);
+      continue;
+    }
+
+    cnpy::npz_save("compressed.npz", "arr1", data.data(), {nz, ny, nx}, "w",
+                   false, method);
+    constexpr double my_var1 = 1.2;
+    cnpy::npz_save("compressed.npz", "my_var1", &my_var1, {1}, "a", false,
+                   method);
+
+    const cnpy::npz_file npz("compressed.npz");
+    const cnpy::npy_array arr = npz.load("arr1");
+    ASSERT_EQ(arr.shape(), std::vector<size_t>({nz, ny, nx}));
+    ASSERT_EQ(arr.as_vec<std::complex<double>>(), data);
+    ASSERT_EQ(npz.load("my_var1").as_vec<double>(),
+              std::vector<double>({my_var1}));
+  }
+
+  // the delta filter does not support 16 byte words
+  EXPECT_THROW(cnpy::npz_save("compressed.npz", "arr1", data.data(),
+                              {nz, ny, nx}, "w", false,
+                              cnpy::compression::deflate,
+                              {cnpy::filter::delta}),
+               std::runtime_error);
+  EXPECT_EQ(cnpy::npz_load("compressed.npz", "arr1").num_vals(), nx * ny * nz);
+}
+
+template <typename T> void check_filters(const size_t n) {
+  std::vector<T> data(n);
+  std::mt19937 generator(0);
+  for (size_t i = 0; i < n; i++) {
+    // slowly increasing values with noise in the low bits
+    data[i] = static_cast<T>(i * 3 + generator() % 5);
+  }
+  const size_t nbytes = n * sizeof(T);
+  const auto *bytes = reinterpret_cast<const char *>(data.data());
+
+  const auto shuffled =
+      cnpy::filter_npz_data({cnpy::filter::shuffle}, data.data(), nbytes,
+                            sizeof(T));
+  for (size_t i = 0; i < n; i++) {
+    for (size_t byte = 0; byte < sizeof(T); byte++) {
+      ASSERT_EQ(shuffled[byte * n + i], bytes[i * sizeof(T) + byte]);
+    }
+  }
+
+  for (const auto &filters : std::vector<std::vector<cnpy::filter>>{
+           {cnpy::filter::shuffle},
+           {cnpy::filter::bitshuffle},
+           {cnpy::filter::delta},
+           {cnpy::filter::delta, cnpy::filter::bitshuffle}}) {
+    auto filtered =
+        cnpy::filter_npz_data(filters, data.data(), nbytes, sizeof(T));
+    ASSERT_EQ(filtered.size(), nbytes);
+    cnpy::unfilter_npz_data(filters, filtered.data(), nbytes, sizeof(T));
+    ASSERT_TRUE(nbytes == 0 ||
+                std::memcmp(filtered.data(), bytes, nbytes) == 0);
+  }
+}
+
+TEST(NpzFilters, Npz) {
+  for (const size_t n : {0, 1, 15, 16, 17, 1000}) {
+    check_filters<uint8_t>(n);
+    check_filters<int16_t>(n);
+    check_filters<int32_t>(n);
+    check_filters<int64_t>(n);
+  }
+
+  const auto data = get_data();
+  EXPECT_THROW(cnpy::filter_npz_data({cnpy::filter::delta}, data.data(),
+                                     data.size() * 16, 16),
+               std::runtime_error);
+
+  // complex<double> has 16 byte words
+  for (const auto &filters : std::vector<std::vector<cnpy::filter>>{
+           {cnpy::filter::shuffle}, {cnpy::filter::bitshuffle}}) {
+    cnpy::npz_save("filtered.npz", "arr1", data.data(), {nz, ny, nx}, "w",
+                   false, cnpy::compression::deflate, filters);
+    const std::vector<long long> timestamps{1000, 1010, 1020, 1031, 1040};
+    cnpy::npz_save("filtered.npz", "t", timestamps, "a",
+                   cnpy::compression::deflate,
+                   {cnpy::filter::delta, cnpy::filter::shuffle});
+
+    cnpy::npz_t npz = cnpy::npz_load("filtered.npz");
+    ASSERT_EQ(npz["arr1"].as_vec<std::complex<double>>(), data);
+    ASSERT_EQ(npz["t"].as_vec<long long>(), timestamps);
+  }
+}
+
+TEST(MalformedInput, Npy) {
+  size_t word_size;
+  std::vector<size_t> shape;
+  bool fortran_order;
+
+  // every truncation of a valid header is rejected
+  const auto header = cnpy::create_npy_header<double>({3, 4});
+  const auto *bytes = reinterpret_cast<const unsigned char *>(header.data());
+  for (size_t size = 0; size < header.size(); size++) {
+    EXPECT_THROW(
+        cnpy::parse_npy_header(bytes, size, word_size, shape, fortran_order),
+        std::runtime_error);
+  }
+  cnpy::parse_npy_header(bytes, header.size(), word_size, shape,
+                         fortran_order);
+  EXPECT_EQ(shape, (std::vector<size_t>{3, 4}));
+
+  const auto with_dict = [](const std::string_view dict) {
+    std::string npy("\x93NUMPY\x01\x00", 8);
+    npy += static_cast<char>(dict.size() & 0xff);
+    npy += static_cast<char>(dict.size() >> 8);
+    npy += dict;
+    return npy;
+  };
+
+  // shapes whose size overflows, and a 16 GB array in a tiny file, fail
+  // before anything is allocated
+  for (const std::string_view dict :
+       {"{'descr': '<f8', 'fortran_order': False, "
+        "'shape': (18446744073709551615,), }\n",
+        "{'descr': '<f8', 'fortran_order': False, "
+        "'shape': (4294967296, 4294967296), }\n",
+        "{'descr': '<f8', 'fortran_order': False, 'shape': (3, -1), }\n",
+        "{'descr': '<f8', 'fortran_order': Maybe, 'shape': (3,), }\n",
+        "{'descr': '>f8', 'fortran_order': False, 'shape': (3,), }\n",
+        "{'descr': '<f8', 'fortran_order': False, 'shape': (3,\n"}) {
+    const std::string npy = with_dict(dict);
+    EXPECT_THROW(cnpy::parse_npy_header(
+                     reinterpret_cast<const unsigned char *>(npy.data()),
+                     npy.size(), word_size, shape, fortran_order),
+                 std::runtime_error)
+        << dict;
+  }
+  // header lengths of 0xffffffff, which wrapped around in 32 bit
+  for (const char version : {'\x02', '\x03'}) {
+    std::string npy("\x93NUMPY", 6);
+    npy += version;
+    npy += std::string("\x00\xff\xff\xff\xff{}", 7);
+    EXPECT_THROW(cnpy::parse_npy_header(
+                     reinterpret_cast<const unsigned char *>(npy.data()),
+                     npy.size(), word_size, shape, fortran_order),
+                 std::runtime_error);
+    write_file("wrapped.npy", npy);
+    EXPECT_THROW(cnpy::npy_load("wrapped.npy"), std::runtime_error);
+    EXPECT_THROW(cnpy::npy_file("wrapped.npy"), std::runtime_error);
+  }
+
+  write_file("huge.npy",
+             with_dict("{'descr': '<f8', 'fortran_order': False, "
+                       "'shape': (2000000000,), }\n"));
+  EXPECT_THROW(cnpy::npy_load("huge.npy"), std::runtime_error);
+  EXPECT_FALSE(cnpy::npy_load_batch({"huge.npy"})[0].status.ok);
+}
+
+TEST(MalformedInput, Npz) {
+  const std::vector<double> data(1000, 1.5);
+  cnpy::npz_save("malformed.npz", "a", data, "w", cnpy::compression::deflate);
+  const std::string zip = read_file("malformed.npz");
+
+  // truncated archives, as left behind by a crashed writer
+  for (size_t size = 0; size < zip.size(); size += 7) {
+    write_file("truncated.npz", std::string_view(zip).substr(0, size));
+    EXPECT_THROW(cnpy::npz_load("truncated.npz"), std::runtime_error) << size;
+  }
+
+  // an uncompressed size far beyond what deflate can produce from the member
+  std::string corrupt = zip;
+  const size_t central_directory = corrupt.find("PK\x01\x02");
+  ASSERT_NE(central_directory, std::string::npos);
+  std::memset(corrupt.data() + central_directory + 24, 0x7f, 4);
+  write_file("corrupt.npz", corrupt);
+  EXPECT_THROW(cnpy::npz_load("corrupt.npz", "a"), std::runtime_error);
+
+  // appending to something that is not a zip file
+  write_file("corrupt.npz", "not a zip file, but longer than a zip footer");
+  EXPECT_THROW(cnpy::npz_save("corrupt.npz", "a", data, "a"),
+               std::runtime_error);
+}
+
+// loads and saves from many threads at once, meant to be run in builds with
+// -DSANITIZE=address or -DSANITIZE=thread
+TEST(ConcurrentStress, Npz) {
+  const cnpy::npz_file shared(npz_file);
+  cnpy::array_cache cache(1 << 10);
+
+  constexpr size_t num_threads = 8;
+  constexpr size_t iterations = 20;
+  std::vector<std::string> errors(num_threads);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < num_threads; t++) {
+    threads.emplace_back([&, t] {
+      const std::string name = "stress" + std::to_string(t);
+      std::vector<int> values(512);
+      try {
+        for (size_t i = 0; i < iterations; i++) {
+          std::iota(values.begin(), values.end(), static_cast<int>(i));
+          cnpy::npy_save(name + ".npy", values.data(), {values.size()},
+                         i == 0 ? "w" : "a");
+          cnpy::npz_save(name + ".npz", "v" + std::to_string(i), values,
+                         i == 0 ? "w" : "a", cnpy::compression::deflate,
+                         {cnpy::filter::shuffle});
+
+          if (shared.load("s").as_vec<long long>() !=
+                  std::vector<long long>{1, 2, 3} ||
+              cache.npz_load(npz_file, "f").num_vals() != 3 ||
+              cache.npz_load(npz_file, "t").num_vals() == 0 ||
+              cnpy::npz_load(name + ".npz", "v" + std::to_string(i))
+                      .as_vec<int>() != values) {
+            errors[t] = "wrong data in iteration " + std::to_string(i);
+            return;
+          }
+        }
+
+        const cnpy::npy_array appended = cnpy::npy_load(name + ".npy");
+        if (appended.num_vals() != iterations * values.size() ||
+            appended.data<int>()[appended.num_vals() - 1] !=
+                static_cast<int>(iterations - 1 + values.size() - 1)) {
+          errors[t] = "wrong appended data";
+        }
+      } catch (const std::exception &e) {
+        errors[t] = e.what();
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  for (const std::string &error : errors) {
+    EXPECT_EQ(error, "");
+  }
+}
+
 int main(int argc, char *argv[]) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();